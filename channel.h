@@ -1,3 +1,5 @@
+#pragma once
+
 #include <deque>
 #include <functional>
 #include <future>
@@ -8,6 +10,22 @@
 #include <vector>
 #include <any>
 #include <queue>
+#include <array>
+#include <iterator>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <ostream>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <shared_mutex>
+#include <optional>
+#include <cmath>
 
 using namespace std::chrono_literals;
 
@@ -17,40 +35,79 @@ using namespace std::chrono_literals;
 #define LOG printf
 #endif
 
+#ifdef CHANNEL_NO_TRACE
+#define TRACE(...) void(0)
+#else
+#define TRACE(...) (gTracer.enabled() ? gTracer.record(__VA_ARGS__) : void(0))
+#endif
+
 namespace Channel {
 
 class Select;
 class Chan;
+struct SelectLatency;
 
 enum METHOD { READ, WRITE };
+enum TRACE_EVENT { TRACE_SELECT, TRACE_REGISTER, TRACE_PARK, TRACE_MATCH, TRACE_HANDOFF, TRACE_WAKE, TRACE_BUFFERED };
 
 using Task = std::function<bool(const std::string &, const std::string &, const std::any&)>;
+using Executor = std::function<void(std::function<void()>)>;
 using Status = std::vector<std::tuple<Select *, METHOD, Chan *>>;
 using NamedStatus = std::set<std::tuple<std::string, METHOD, std::string>>;
 
+struct Waiter {
+    Select *pSelect;
+    METHOD method;
+    std::string selectName;
+    std::chrono::steady_clock::time_point since;
+};
+using WaiterSnapshot = std::vector<Waiter>;
+
+// thrown by a parked Select that was cancelled
+struct Cancelled : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
 struct Command {
     Channel::Chan *pChan;
     METHOD method;
     std::any pVal;
+    int priority = 0; // only used by priority chans, higher goes first
 };
 
 class Case {
   public:
     Case() = default;
     Case(const Case &case_) = default;
+    Case(Case &&case_) = default;
+    Case &operator=(const Case &case_) = default;
+    Case &operator=(Case &&case_) = default;
+    // a write case without pFunc hands its value over to the chan by move
     Case(Command&& command, Task pFunc) : mMethod(command.method),
         mpChan(command.pChan),
-        mpVal(command.pVal),
-        mpFunc(pFunc) {}
+        mpVal(std::move(command.pVal)),
+        mPriority(command.priority),
+        mpFunc(std::move(pFunc)) {}
+    // run pFunc on executor instead of the thread completing the match
+    Case(Command&& command, Task pFunc, Executor executor) : mMethod(command.method),
+        mpChan(command.pChan),
+        mpVal(std::move(command.pVal)),
+        mPriority(command.priority),
+        mpFunc(std::move(pFunc)),
+        mExecutor(std::move(executor)) {}
 
   private:
     friend class Select;
+    friend class Chan;
     void exec(const Select *pSelect);
     bool tryExec(const Select *pSelect);
+    void invoke(const Select *pSelect);
     METHOD mMethod;
     Chan *mpChan = nullptr;
     std::any mpVal;
+    int mPriority = 0;
     Task mpFunc;
+    Executor mExecutor;
 };
 using Default = Case;
 
@@ -69,36 +126,383 @@ class Select {
     template <typename T> void doSelect(const std::string &name, T begin, T end);
     void doSelect(const std::string &name, std::initializer_list<Case> caseVec);
     friend class Case;
-    friend Status watchStatus(const std::vector<Chan *> &chanVec);
-    friend NamedStatus watchNamedStatus(const std::vector<Chan *> &chanVec);
+    friend class Chan;
     friend void printStatus(const Status &status);
+    friend void cancel(const std::vector<Chan *> &chanVec);
+    void recordMatch(bool parked) const;
 
     std::string mName;
     std::map<Chan *, Case> mpChan2Case;
     std::mutex mMutex;
     std::condition_variable mCv;
     Chan *mpChanTobeNotified{nullptr};
+    uint64_t mTraceFlow{0}; // set with mpChanTobeNotified, links MATCH to WAKE
+    bool mAdmitted{false}; // set with mpChanTobeNotified, the write went into the buffer
+    bool mCancelled{false}; // set with mpChanTobeNotified, no case was chosen
+    std::chrono::steady_clock::time_point mParkedSince;
+    SelectLatency *mpLatency{nullptr}; // set on entry while latency recording is on
+    std::chrono::steady_clock::time_point mEnteredAt;
 };
 
 Command operator>>(Chan*pChan, std::any pVal) {
-    return Command{pChan, METHOD::READ, pVal};
+    return Command{pChan, METHOD::READ, std::move(pVal)};
 }
 
 Command operator<<(Chan*pChan, std::any pVal) {
-    return Command{pChan, METHOD::WRITE, pVal};
+    return Command{pChan, METHOD::WRITE, std::move(pVal)};
 }
 
+Command prioritized(Command command, int priority) {
+    command.priority = priority;
+    return command;
+}
+
+struct Serializer {
+    std::function<std::string(const std::any &)> save;
+    std::function<std::any(const std::string &)> load;
+};
+
+template <typename T> Serializer trivialSerializer() {
+    static_assert(std::is_trivially_copyable_v<T>, "spilled payload must be trivially copyable");
+    return Serializer{
+        [](const std::any & val) {
+            const T &t = std::any_cast<const T &>(val);
+            return std::string(reinterpret_cast<const char *>(&t), sizeof(T));
+        },
+        [](const std::string & data) {
+            T t;
+            std::memcpy(&t, data.data(), sizeof(T));
+            return std::any(t);
+        }
+    };
+}
+
+struct SpillConfig {
+    std::string directory;
+    Serializer serializer;
+    size_t segmentSize = 64 << 20;
+};
+
+// FIFO of serialized payloads in append-only memory-mapped segment files,
+// a segment is unlinked once its last record is read back and the writer has
+// moved on to the next one; a drained tail segment is rewound and reused.
+// segments only live as long as the queue, they are not recovered after a crash.
+// push and pop run under the coordinator lock, so they only copy memory: a spill
+// thread keeps the next segment open and mapped, prefaults the pages ahead of
+// the writer, reads ahead of the reader and unmaps consumed segments
+class SpillQueue {
+  public:
+    static constexpr size_t kAhead = 1 << 20; // bytes prefaulted ahead of the writer / read ahead of the reader
+
+    SpillQueue(SpillConfig config, const std::string &name) : mConfig(std::move(config)) {
+        static std::atomic<uint64_t> queueId{0};
+        mPrefix = mConfig.directory + "/" + (name.empty() ? "chan" : name) + "." +
+                  std::to_string(getpid()) + "." + std::to_string(queueId++);
+        mThread = std::thread([this]() {
+            run();
+        });
+    }
+    SpillQueue(const SpillQueue &) = delete;
+    SpillQueue &operator=(const SpillQueue &) = delete;
+
+    ~SpillQueue() {
+        {
+            std::unique_lock<std::mutex> lock(mIoMutex);
+            mStop = true;
+        }
+        mIoCv.notify_one();
+        mThread.join();
+        for (auto &segment : mSegments) release(segment);
+        for (auto &segment : mRetired) release(segment);
+        if (mSpare) release(*mSpare);
+    }
+
+    void push(const std::any &val) {
+        std::string data = mConfig.serializer.save(val);
+        uint32_t len = static_cast<uint32_t>(data.size());
+        size_t need = sizeof(len) + data.size();
+        if (mSegments.empty() || mSegments.back().writeOffset + need > mSegments.back().size) {
+            mSegments.push_back(takeSpare(need));
+        }
+        Segment &segment = mSegments.back();
+        std::memcpy(segment.pData + segment.writeOffset, &len, sizeof(len));
+        std::memcpy(segment.pData + segment.writeOffset + sizeof(len), data.data(), data.size());
+        segment.writeOffset += need;
+        mCount++;
+        if (segment.writeOffset + kAhead > segment.populated && segment.populated < segment.size) {
+            size_t from = segment.populated;
+            segment.populated = std::min(segment.size, segment.writeOffset + 2 * kAhead);
+            std::unique_lock<std::mutex> lock(mIoMutex);
+            mPopulate = Range{segment.pData, from, segment.populated};
+            mIoCv.notify_one();
+        }
+    }
+
+    std::any pop() {
+        Segment &segment = mSegments.front();
+        uint32_t len;
+        std::memcpy(&len, segment.pData + segment.readOffset, sizeof(len));
+        std::string data(segment.pData + segment.readOffset + sizeof(len), len);
+        segment.readOffset += sizeof(len) + len;
+        mCount--;
+        if (segment.readOffset == segment.writeOffset && mSegments.size() == 1 && segment.size == mConfig.segmentSize) {
+            // the reader caught up with the writer, keep filling the same segment
+            segment.readOffset = segment.writeOffset = segment.readAhead = 0;
+        } else if (segment.readOffset == segment.writeOffset) {
+            std::unique_lock<std::mutex> lock(mIoMutex);
+            mRetired.push_back(segment);
+            mSegments.pop_front();
+            mIoCv.notify_one();
+        } else if (segment.readOffset + kAhead > segment.readAhead && segment.readAhead < segment.writeOffset) {
+            size_t from = segment.readAhead;
+            segment.readAhead = std::min(segment.writeOffset, segment.readOffset + 2 * kAhead);
+            std::unique_lock<std::mutex> lock(mIoMutex);
+            mReadAhead = Range{segment.pData, from, segment.readAhead};
+            mIoCv.notify_one();
+        }
+        return mConfig.serializer.load(data);
+    }
+
+    bool empty() const {
+        return mCount == 0;
+    }
+    size_t size() const {
+        return mCount;
+    }
+
+  private:
+    struct Segment {
+        std::string path;
+        int fd;
+        char *pData;
+        size_t size;
+        size_t writeOffset;
+        size_t readOffset;
+        size_t populated; // prefault requested up to here
+        size_t readAhead; // read ahead requested up to here
+    };
+
+    struct Range {
+        char *pData = nullptr;
+        size_t from = 0;
+        size_t to = 0;
+    };
+
+    // the spare prepared by the spill thread, or a segment opened in place
+    // when none is ready yet or the record does not fit
+    Segment takeSpare(size_t need) {
+        std::optional<Segment> spare;
+        {
+            std::unique_lock<std::mutex> lock(mIoMutex);
+            if (mSpare && mSpare->size >= need) {
+                spare.swap(mSpare);
+            }
+            mSpareWanted = true;
+        }
+        mIoCv.notify_one();
+        return spare ? *spare : openSegment(std::max(mConfig.segmentSize, need));
+    }
+
+    void run() {
+        while (true) {
+            std::vector<Segment> retired;
+            Range populate, readAhead;
+            bool spareWanted = false;
+            {
+                std::unique_lock<std::mutex> lock(mIoMutex);
+                mIoCv.wait(lock, [this]() {
+                    return mStop || (mSpareWanted && !mSpare) || !mRetired.empty() ||
+                           mPopulate.pData || mReadAhead.pData;
+                });
+                if (mStop) return;
+                retired.swap(mRetired);
+                std::swap(populate, mPopulate);
+                std::swap(readAhead, mReadAhead);
+                spareWanted = mSpareWanted && !mSpare;
+            }
+            // a segment only gets unmapped here, so the ranges stay valid
+            advise(populate, MADV_POPULATE_WRITE);
+            advise(readAhead, MADV_WILLNEED);
+            for (auto &segment : retired) release(segment);
+            if (!spareWanted) continue;
+            try {
+                Segment spare = openSegment(mConfig.segmentSize);
+                spare.populated = std::min(spare.size, kAhead);
+                advise(Range{spare.pData, 0, spare.populated}, MADV_POPULATE_WRITE);
+                std::unique_lock<std::mutex> lock(mIoMutex);
+                mSpare = spare;
+                mSpareWanted = false;
+            } catch (const std::runtime_error &) {
+                // push opens the segment itself and reports the error
+                std::unique_lock<std::mutex> lock(mIoMutex);
+                mSpareWanted = false;
+            }
+        }
+    }
+
+    // hints only, failures (e.g. kernels without MADV_POPULATE_WRITE) are ignored
+    static void advise(const Range &range, int advice) {
+        if (!range.pData || range.from >= range.to) return;
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t from = range.from / page * page;
+        size_t to = (range.to + page - 1) / page * page;
+        madvise(range.pData + from, to - from, advice);
+    }
+
+    Segment openSegment(size_t size) {
+        std::string path = mPrefix + "." + std::to_string(mSegmentId++) + ".seg";
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            throw std::runtime_error("open " + path + ": " + strerror(errno));
+        }
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            int err = errno;
+            close(fd);
+            unlink(path.c_str());
+            throw std::runtime_error("ftruncate " + path + ": " + strerror(err));
+        }
+        void *pData = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (pData == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            unlink(path.c_str());
+            throw std::runtime_error("mmap " + path + ": " + strerror(err));
+        }
+        return Segment{path, fd, static_cast<char *>(pData), size, 0, 0, 0, 0};
+    }
+
+    static void release(Segment &segment) {
+        munmap(segment.pData, segment.size);
+        close(segment.fd);
+        unlink(segment.path.c_str());
+    }
+
+    SpillConfig mConfig;
+    std::string mPrefix;
+    std::atomic<uint64_t> mSegmentId{0}; // bumped by both push and the spill thread
+    size_t mCount{0};
+    std::deque<Segment> mSegments;
+
+    std::mutex mIoMutex; // protect the members below, never held across a syscall
+    std::condition_variable mIoCv;
+    std::optional<Segment> mSpare;
+    bool mSpareWanted{true};
+    std::vector<Segment> mRetired;
+    Range mPopulate;
+    Range mReadAhead;
+    bool mStop{false};
+    std::thread mThread;
+};
+
+struct PriorityConfig {
+    int levels = 2;
+    std::chrono::nanoseconds aging = 10ms; // a buffered value gains one level per aging it waits
+};
+
+// one FIFO per level, each bounded by the chan capacity so that a saturated
+// low level never blocks writers of a higher one
+class PriorityBuffer {
+  public:
+    explicit PriorityBuffer(PriorityConfig config) : mConfig(config), mLevels(config.levels) {}
+
+    int level(int priority) const {
+        return std::clamp(priority, 0, mConfig.levels - 1);
+    }
+
+    size_t size(int priority) const {
+        return mLevels[level(priority)].size();
+    }
+
+    size_t size() const {
+        return mCount;
+    }
+
+    bool empty() const {
+        return mCount == 0;
+    }
+
+    void push(int priority, std::any val) {
+        mLevels[level(priority)].emplace_back(std::chrono::steady_clock::now(), std::move(val));
+        mCount++;
+    }
+
+    // the head with the highest aged level goes first, ties go to the higher level
+    std::any pop() {
+        auto now = std::chrono::steady_clock::now();
+        int best = -1;
+        int64_t bestLevel = 0;
+        for (int i = mConfig.levels - 1; i >= 0; i--) {
+            if (mLevels[i].empty()) continue;
+            int64_t aged = i;
+            if (mConfig.aging.count() > 0) aged += (now - mLevels[i].front().first) / mConfig.aging;
+            if (best < 0 || aged > bestLevel) {
+                best = i;
+                bestLevel = aged;
+            }
+        }
+        std::any ret = std::move(mLevels[best].front().second);
+        mLevels[best].pop_front();
+        mCount--;
+        return ret;
+    }
+
+  private:
+    PriorityConfig mConfig;
+    std::vector<std::deque<std::pair<std::chrono::steady_clock::time_point, std::any>>> mLevels;
+    size_t mCount{0};
+};
+
+struct AdaptiveConfig {
+    int minCapacity = 1;
+    int maxCapacity = 1024;
+    std::chrono::nanoseconds window = 100ms; // block statistics are evaluated once per window
+};
+
+struct ResizeEvent {
+    std::chrono::steady_clock::time_point when;
+    int from;
+    int to;
+};
+
 class Chan {
   public:
     Chan(const std::string &name = "") : mName(name) {};
     Chan(int capacity, const std::string &name = "") : mCapacity(capacity), mName(name) {};
+    // writes never block, overflow beyond capacity is spilled to disk
+    Chan(int capacity, SpillConfig config, const std::string &name = "") : mName(name),
+        mCapacity(capacity),
+        mpSpill(std::make_unique<SpillQueue>(std::move(config), name)) {
+        if (capacity <= 0) throw std::runtime_error("spilling chan must be buffered");
+    }
+    // capacity bounds every level, reads take the highest aged level first
+    Chan(int capacity, PriorityConfig config, const std::string &name = "") : mName(name),
+        mCapacity(capacity),
+        mpPriority(std::make_unique<PriorityBuffer>(config)) {
+        if (capacity <= 0 || config.levels <= 0) throw std::runtime_error("invalid priority chan");
+    }
+    // capacity doubles after a window in which writers blocked, and halves after
+    // a window in which the buffer stayed below a quarter of it
+    Chan(AdaptiveConfig config, const std::string &name = "") : mName(name),
+        mCapacity(config.minCapacity),
+        mpAdaptive(std::make_unique<Adaptive>()) {
+        if (config.minCapacity <= 0 || config.maxCapacity < config.minCapacity) {
+            throw std::runtime_error("invalid adaptive capacity bounds");
+        }
+        mpAdaptive->config = config;
+        mpAdaptive->windowStart = std::chrono::steady_clock::now();
+    }
 
 
-    void doWrite(const Select *pSelect, std::any& val) {
+    void doWrite(const Select *pSelect, std::any& val, bool move = false) {
         std::unique_lock<std::mutex> lock(mMutex);
-
-        mPayload = val;
-        mCv.notify_one();
+        // another matched pair may not have handed its payload over yet
+        mCv.wait(lock, [&] { return !mPayload.has_value(); });
+        if (move) {
+            mPayload = std::move(val);
+        } else {
+            mPayload = val;
+        }
+        mCv.notify_all();
     }
 
     void doRead(const Select *pSelect, std::any& val) {
@@ -106,15 +510,39 @@ class Chan {
         mCv.wait(lock, [&] { return mPayload.has_value(); });
         val.swap(mPayload);
         mPayload.reset();
-
+        mCv.notify_all();
     }
 
-    bool tryWrite(const Select *pSelect, std::any& val) {
+    bool tryWrite(const Select *pSelect, std::any& val, bool move = false, int priority = 0) {
         std::unique_lock<std::mutex> lock(mMutex);
-        if (full()) {
+        if (mpPriority) {
+            if (mpPriority->size(priority) >= static_cast<size_t>(mCapacity)) {
+                return false;
+            }
+            mpPriority->push(priority, move ? std::move(val) : val);
+            return true;
+        }
+        if (mpSpill && (mBuffer.size() >= mCapacity || !mpSpill->empty())) {
+            mpSpill->push(val); // keep FIFO, everything in memory is older
+            return true;
+        }
+        if (mpAdaptive) {
+            adapt();
+            // room a resize made goes to the writers parked before this one
+            admitWaitingWriters();
+        }
+        if (full() || (!waitingSelectList.empty() && waitingSelectList.back().second == WRITE)) {
             return false;
         }
-        mBuffer.emplace(val);
+        if (move) {
+            mBuffer.emplace(std::move(val));
+        } else {
+            mBuffer.emplace(val);
+        }
+        if (mpAdaptive) {
+            mpAdaptive->highWater = std::max(mpAdaptive->highWater, mBuffer.size());
+            adapt();
+        }
         return true;
     }
 
@@ -123,8 +551,19 @@ class Chan {
         if (empty()) {
             return false;
         }
+        if (mpPriority) {
+            val = mpPriority->pop();
+            admitWaitingWriter();
+            return true;
+        }
         val.swap(mBuffer.front());
         mBuffer.pop();
+        if (mpAdaptive) adapt();
+        if (mpSpill && !mpSpill->empty()) {
+            mBuffer.push(mpSpill->pop());
+        } else {
+            admitWaitingWriters();
+        }
 
         return true;
     }
@@ -140,61 +579,673 @@ class Chan {
     }
 
     bool empty() const {
-        return mBuffer.size() == 0;
+        return mpPriority ? mpPriority->empty() : mBuffer.size() == 0;
     }
     bool full() const {
-        return mBuffer.size() >= mCapacity;
+        return !mpSpill && mBuffer.size() >= mCapacity;
     }
     bool isBuffered() const {
         return mCapacity > 0;
     }
 
     void write(std::any val, Task fun) {
-        Select{mName, Case{this << val, fun}};
+        Select{mName, Case{this << std::move(val), std::move(fun)}};
     }
 
     void read(std::any val, Task fun) {
-        Select{mName, Case{this >> val, fun}};
+        Select{mName, Case{this >> std::move(val), std::move(fun)}};
+    }
+
+    void write(std::any val, Task fun, Executor executor) {
+        Select{mName, Case{this << std::move(val), std::move(fun), std::move(executor)}};
+    }
+
+    void read(std::any val, Task fun, Executor executor) {
+        Select{mName, Case{this >> std::move(val), std::move(fun), std::move(executor)}};
+    }
+
+    void write(std::any val, Task fun, int priority) {
+        Select{mName, Case{prioritized(this << std::move(val), priority), std::move(fun)}};
     }
 
     std::string getName() const {
         return mName;
     }
 
-    size_t getCapacity() const {
+    // never takes the coordinator lock, may lag behind waitingSelectList
+    std::shared_ptr<const WaiterSnapshot> getWaiters() const {
+        return mWaiters.load(std::memory_order_acquire);
+    }
+
+    // an adaptive chan catches up on the windows it sat idle first
+    size_t getCapacity() {
+        if (mpAdaptive) {
+            std::unique_lock<std::mutex> lock(mMutex);
+            adapt();
+        }
         return mCapacity;
     }
 
+    std::vector<ResizeEvent> getResizeHistory() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (mpAdaptive) adapt();
+        return mpAdaptive ? std::vector<ResizeEvent>(mpAdaptive->history.begin(), mpAdaptive->history.end())
+               : std::vector<ResizeEvent> {};
+    }
+
+    size_t getSpilled() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        return mpSpill ? mpSpill->size() : 0;
+    }
+
   private:
     friend class Case;
     friend class Select;
-    friend Status watchStatus(const std::vector<Chan *> &chanVec);
-    friend NamedStatus watchNamedStatus(const std::vector<Chan *> &chanVec);
+    friend struct Coordinator;
     friend void printStatus(const Status &status);
+    friend void cancel(const std::vector<Chan *> &chanVec);
+
+    struct Adaptive {
+        AdaptiveConfig config;
+        std::chrono::steady_clock::time_point windowStart;
+        size_t writerBlocks = 0;
+        std::chrono::nanoseconds writerBlocked{0};
+        std::chrono::nanoseconds readerBlocked{0};
+        size_t highWater = 0;
+        std::deque<ResizeEvent> history; // latest kHistorySize resizes
+    };
+    static constexpr size_t kHistorySize = 64;
+
+    // a select is about to park on this chan
+    void noteBlocked(METHOD method) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (method == WRITE) mpAdaptive->writerBlocks++;
+        adapt();
+    }
+
+    void noteParked(METHOD method, std::chrono::nanoseconds parked) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        (method == WRITE ? mpAdaptive->writerBlocked : mpAdaptive->readerBlocked) += parked;
+    }
+
+    // called with mMutex held. every window that has passed is evaluated, the
+    // ones without any operation on the chan count as quiet
+    void adapt() {
+        auto now = std::chrono::steady_clock::now();
+        Adaptive &adaptive = *mpAdaptive;
+        auto window = adaptive.config.window;
+        while (now - adaptive.windowStart >= window) {
+            int from = mCapacity;
+            int to = from;
+            if (adaptive.writerBlocks > 0 || adaptive.writerBlocked > adaptive.readerBlocked) {
+                to = std::min(from * 2, adaptive.config.maxCapacity);
+            } else if (adaptive.highWater * 4 <= static_cast<size_t>(from)) {
+                to = std::max(from / 2, adaptive.config.minCapacity);
+            }
+            adaptive.windowStart += window;
+            if (to != from) {
+                mCapacity = to;
+                adaptive.history.push_back(ResizeEvent{adaptive.windowStart, from, to});
+                if (adaptive.history.size() > kHistorySize) adaptive.history.pop_front();
+                LOG("%s resized from %d to %d\n", mName.c_str(), from, to);
+            } else if (mBuffer.size() * 4 > static_cast<size_t>(from) || from == adaptive.config.minCapacity) {
+                // the remaining quiet windows would not change anything either
+                adaptive.windowStart += (now - adaptive.windowStart) / window * window;
+            }
+            adaptive.writerBlocks = 0;
+            adaptive.writerBlocked = adaptive.readerBlocked = std::chrono::nanoseconds{0};
+            adaptive.highWater = mBuffer.size();
+        }
+    }
+
+    bool admitWaitingWriter();
+
+    // called with gCoordinator's lock and mMutex held
+    void admitWaitingWriters() {
+        while (!full() && admitWaitingWriter()) {}
+        if (mpAdaptive) mpAdaptive->highWater = std::max(mpAdaptive->highWater, mBuffer.size());
+    }
+
+    // called with gCoordinator's lock held
+    void publishWaiters() {
+        auto pWaiters = std::make_shared<WaiterSnapshot>();
+        pWaiters->reserve(waitingSelectList.size());
+        for (auto &[pSelect, method] : waitingSelectList) {
+            pWaiters->push_back(Waiter{pSelect, method, pSelect->mName, pSelect->mParkedSince});
+        }
+        mWaiters.store(std::move(pWaiters), std::memory_order_release);
+    }
+
     std::string mName;
 
     std::queue<std::any> mBuffer{};
-    int mCapacity{0};
+    std::atomic<int> mCapacity{0};
     std::any mPayload;
+    std::unique_ptr<SpillQueue> mpSpill;
+    std::unique_ptr<PriorityBuffer> mpPriority;
+    std::unique_ptr<Adaptive> mpAdaptive;
 
-    std::mutex mMutex; // protect mBuffer
+    std::mutex mMutex; // protect mBuffer and mpSpill
     std::condition_variable mCv;
 
     std::list<std::pair<Select *, METHOD>> waitingSelectList;
+    std::atomic<std::shared_ptr<const WaiterSnapshot>> mWaiters{std::make_shared<const WaiterSnapshot>()};
+};
+
+class ThreadPool {
+  public:
+    explicit ThreadPool(size_t threadNum = std::thread::hardware_concurrency()) {
+        if (threadNum == 0) threadNum = 1;
+        for (size_t i = 0; i < threadNum; i++) {
+            mThreads.emplace_back([this]() {
+                run();
+            });
+        }
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // pending jobs are drained before the workers exit
+    ~ThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCv.notify_all();
+        for (auto &t : mThreads) {
+            t.join();
+        }
+    }
+
+    void post(std::function<void()> job) {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mJobs.push_back(std::move(job));
+        }
+        mCv.notify_one();
+    }
+
+    Executor executor() {
+        return [this](std::function<void()> job) {
+            post(std::move(job));
+        };
+    }
+
+  private:
+    void run() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCv.wait(lock, [this] { return mStop || !mJobs.empty(); });
+                if (mJobs.empty()) return;
+                job = std::move(mJobs.front());
+                mJobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::mutex mMutex; // protect mJobs and mStop
+    std::condition_variable mCv;
+    std::deque<std::function<void()>> mJobs;
+    bool mStop{false};
+    std::vector<std::thread> mThreads;
+};
+
+struct TraceRecord {
+    uint64_t ts; // ns, steady clock
+    uint64_t flow;
+    TRACE_EVENT event;
+    char selectName[32];
+    char chanName[32];
+};
+
+// single producer ring, the owning thread overwrites the oldest records
+class TraceBuffer {
+  public:
+    static constexpr size_t kSize = 4096;
+
+    explicit TraceBuffer(uint32_t tid) : mTid(tid) {}
+
+    void push(TRACE_EVENT event, const std::string &selectName,
+              const std::string &chanName, uint64_t flow) {
+        uint64_t pos = mHead.load(std::memory_order_relaxed);
+        Slot &slot = mSlots[pos % kSize];
+        slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        TraceRecord &r = slot.record;
+        r.ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+        r.flow = flow;
+        r.event = event;
+        copyName(r.selectName, selectName);
+        copyName(r.chanName, chanName);
+        slot.seq.store(2 * pos + 2, std::memory_order_release);
+        mHead.store(pos + 1, std::memory_order_release);
+    }
+
+    // records torn by a concurrent push are skipped
+    void collect(std::vector<std::pair<uint32_t, TraceRecord>> &out) const {
+        uint64_t head = mHead.load(std::memory_order_acquire);
+        for (uint64_t pos = head > kSize ? head - kSize : 0; pos < head; pos++) {
+            const Slot &slot = mSlots[pos % kSize];
+            if (slot.seq.load(std::memory_order_acquire) != 2 * pos + 2) continue;
+            TraceRecord r;
+            std::memcpy(&r, &slot.record, sizeof(r));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != 2 * pos + 2) continue;
+            out.emplace_back(mTid, r);
+        }
+    }
+
+  private:
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        TraceRecord record;
+    };
+
+    static void copyName(char (&dst)[32], const std::string &src) {
+        size_t len = std::min(src.size(), sizeof(dst) - 1);
+        std::memcpy(dst, src.data(), len);
+        dst[len] = '\0';
+    }
+
+    uint32_t mTid;
+    std::atomic<uint64_t> mHead{0};
+    Slot mSlots[kSize];
+};
+
+class Tracer {
+  public:
+    void start() {
+        mEnabled.store(true, std::memory_order_relaxed);
+    }
+    void stop() {
+        mEnabled.store(false, std::memory_order_relaxed);
+    }
+    bool enabled() const {
+        return mEnabled.load(std::memory_order_relaxed);
+    }
+    uint64_t nextFlow() {
+        return mFlow.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    void record(TRACE_EVENT event, const std::string &selectName,
+                const std::string &chanName, uint64_t flow = 0) {
+        thread_local BufferOwner owner(*this);
+        owner.pBuffer->push(event, selectName, chanName, flow);
+    }
+
+    // Chrome trace event format, loadable by chrome://tracing and Perfetto
+    void dump(std::ostream &os) {
+        std::vector<std::pair<uint32_t, TraceRecord>> records;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            for (auto &pBuffer : mBuffers) {
+                pBuffer->collect(records);
+            }
+        }
+        static const char *names[] = {"select", "register", "parked", "match", "handoff", "parked", "buffered"};
+        os << "{\"traceEvents\":[";
+        bool first = true;
+        auto emit = [&](const TraceRecord &r, uint32_t tid, const char *name, const char *ph, const char *extra) {
+            char ts[32];
+            snprintf(ts, sizeof(ts), "%.3f", r.ts / 1000.0);
+            os << (first ? "\n" : ",\n") << "{\"name\":\"" << name << "\",\"cat\":\"channel\",\"ph\":\"" << ph
+               << "\",\"ts\":" << ts << ",\"pid\":1,\"tid\":" << tid << extra
+               << ",\"args\":{\"select\":\"" << escape(r.selectName) << "\",\"chan\":\"" << escape(r.chanName) << "\"}}";
+            first = false;
+        };
+        for (auto &[tid, r] : records) {
+            std::string flow = ",\"id\":" + std::to_string(r.flow);
+            switch (r.event) {
+            case TRACE_PARK:
+                emit(r, tid, names[r.event], "B", "");
+                break;
+            case TRACE_WAKE:
+                emit(r, tid, names[r.event], "E", "");
+                if (r.flow) emit(r, tid, "wakeup", "f", (flow + ",\"bp\":\"e\"").c_str());
+                break;
+            case TRACE_MATCH:
+                emit(r, tid, names[r.event], "i", ",\"s\":\"t\"");
+                if (r.flow) emit(r, tid, "wakeup", "s", flow.c_str());
+                break;
+            default:
+                emit(r, tid, names[r.event], "i", ",\"s\":\"t\"");
+            }
+        }
+        os << "\n]}\n";
+    }
+
+  private:
+    // hands the buffer back when its thread exits, so buffers are bounded by
+    // the peak number of recording threads. a reused buffer keeps its tid and
+    // the records of the previous owner until they are overwritten
+    struct BufferOwner {
+        explicit BufferOwner(Tracer &tracer) : tracer(tracer), pBuffer(tracer.attach()) {}
+        ~BufferOwner() {
+            tracer.detach(pBuffer);
+        }
+        Tracer &tracer;
+        TraceBuffer *pBuffer;
+    };
+
+    TraceBuffer *attach() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if (!mFreeBuffers.empty()) {
+            TraceBuffer *pBuffer = mFreeBuffers.back();
+            mFreeBuffers.pop_back();
+            return pBuffer;
+        }
+        mBuffers.emplace_back(new TraceBuffer(static_cast<uint32_t>(mBuffers.size() + 1)));
+        return mBuffers.back().get();
+    }
+
+    void detach(TraceBuffer *pBuffer) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mFreeBuffers.push_back(pBuffer);
+    }
+
+    static std::string escape(const char *str) {
+        std::string ret;
+        for (; *str; str++) {
+            if (*str == '"' || *str == '\\') ret += '\\';
+            if (static_cast<unsigned char>(*str) < 0x20) continue;
+            ret += *str;
+        }
+        return ret;
+    }
+
+    std::atomic<bool> mEnabled{false};
+    std::atomic<uint64_t> mFlow{0};
+    std::mutex mMutex; // protect mBuffers and mFreeBuffers, taken on a thread's first record, its exit and in dump
+    std::vector<std::unique_ptr<TraceBuffer>> mBuffers; // kept after their threads exit
+    std::vector<TraceBuffer *> mFreeBuffers; // owned by mBuffers, not attached to any thread
+};
+Tracer gTracer;
+
+void startTrace() {
+    gTracer.start();
+}
+
+void stopTrace() {
+    gTracer.stop();
+}
+
+void dumpTrace(std::ostream &os) {
+    gTracer.dump(os);
+}
+
+// log-linear buckets over nanoseconds: values below 16 are exact, above that
+// every power of two is split into 16 buckets, so the error stays under 1/16
+class LatencyHistogram {
+  public:
+    static constexpr int kSubBits = 4;
+    static constexpr int kSub = 1 << kSubBits;
+    static constexpr int kBuckets = (64 - kSubBits + 1) * kSub;
+
+    static int bucket(uint64_t ns) {
+        if (ns < kSub) return static_cast<int>(ns);
+        int msb = 63 - __builtin_clzll(ns);
+        int shift = msb - kSubBits;
+        return (shift + 1) * kSub + static_cast<int>((ns >> shift) - kSub);
+    }
+
+    // the largest value that falls into bucket index
+    static uint64_t highest(int index) {
+        if (index < kSub) return index;
+        int shift = index / kSub - 1;
+        uint64_t low = static_cast<uint64_t>(kSub + index % kSub) << shift;
+        return low + ((uint64_t{1} << shift) - 1);
+    }
+
+    void record(std::chrono::nanoseconds duration) {
+        uint64_t ns = duration.count() > 0 ? duration.count() : 0;
+        mCounts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        mSum.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = mMax.load(std::memory_order_relaxed);
+        while (ns > max && !mMax.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+    }
+
+  private:
+    friend struct HistogramSnapshot;
+    std::array<std::atomic<uint64_t>, kBuckets> mCounts{};
+    std::atomic<uint64_t> mSum{0};
+    std::atomic<uint64_t> mMax{0};
 };
 
+struct HistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0; // ns
+    uint64_t max = 0; // ns
+    std::vector<uint64_t> counts;
+
+    HistogramSnapshot() = default;
+    // buckets are read one by one, concurrent records may land on either side
+    HistogramSnapshot(LatencyHistogram &histogram, bool reset) : counts(LatencyHistogram::kBuckets) {
+        for (int i = 0; i < LatencyHistogram::kBuckets; i++) {
+            counts[i] = reset ? histogram.mCounts[i].exchange(0, std::memory_order_relaxed)
+                        : histogram.mCounts[i].load(std::memory_order_relaxed);
+            count += counts[i];
+        }
+        sum = reset ? histogram.mSum.exchange(0, std::memory_order_relaxed) : histogram.mSum.load(std::memory_order_relaxed);
+        max = reset ? histogram.mMax.exchange(0, std::memory_order_relaxed) : histogram.mMax.load(std::memory_order_relaxed);
+    }
+
+    // p in [0, 100], reported as the highest value of the bucket holding it
+    std::chrono::nanoseconds percentile(double p) const {
+        if (count == 0) return std::chrono::nanoseconds{0};
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p / 100.0 * count)));
+        uint64_t acc = 0;
+        for (int i = 0; i < LatencyHistogram::kBuckets; i++) {
+            acc += counts[i];
+            if (acc >= rank) return std::chrono::nanoseconds(std::min(LatencyHistogram::highest(i), max));
+        }
+        return std::chrono::nanoseconds(max);
+    }
+
+    std::chrono::nanoseconds mean() const {
+        return std::chrono::nanoseconds(count ? sum / count : 0);
+    }
+};
+
+// recorded per select name: entry to match, time parked (only for Selects
+// that parked) and time spent in the Task
+struct SelectLatency {
+    LatencyHistogram match;
+    LatencyHistogram parked;
+    LatencyHistogram task;
+};
+
+struct SelectLatencySnapshot {
+    HistogramSnapshot match;
+    HistogramSnapshot parked;
+    HistogramSnapshot task;
+};
+
+class LatencyRecorder {
+  public:
+    void start() {
+        mEnabled.store(true, std::memory_order_relaxed);
+    }
+    void stop() {
+        mEnabled.store(false, std::memory_order_relaxed);
+    }
+    bool enabled() const {
+        return mEnabled.load(std::memory_order_relaxed);
+    }
+
+    // entries are never erased, so the pointer stays valid
+    SelectLatency *get(const std::string &selectName) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mMutex);
+            auto it = mStats.find(selectName);
+            if (it != mStats.end()) return it->second.get();
+        }
+        std::unique_lock<std::shared_mutex> lock(mMutex);
+        auto &pStats = mStats[selectName];
+        if (!pStats) pStats.reset(new SelectLatency);
+        return pStats.get();
+    }
+
+    std::map<std::string, SelectLatencySnapshot> snapshot(bool reset) {
+        std::map<std::string, SelectLatencySnapshot> ret;
+        std::shared_lock<std::shared_mutex> lock(mMutex);
+        for (auto &[name, pStats] : mStats) {
+            ret[name] = SelectLatencySnapshot{{pStats->match, reset}, {pStats->parked, reset}, {pStats->task, reset}};
+        }
+        return ret;
+    }
+
+  private:
+    std::atomic<bool> mEnabled{false};
+    std::shared_mutex mMutex; // protect mStats, exclusive only to add a new name
+    std::map<std::string, std::unique_ptr<SelectLatency>> mStats;
+};
+LatencyRecorder gLatency;
+
+void startLatency() {
+    gLatency.start();
+}
+
+void stopLatency() {
+    gLatency.stop();
+}
+
+// with reset the histograms restart from zero, one interval per call
+std::map<std::string, SelectLatencySnapshot> latencySnapshot(bool reset = false) {
+    return gLatency.snapshot(reset);
+}
+
+void printLatencySnapshot(const std::map<std::string, SelectLatencySnapshot> &snapshot) {
+    auto us = [](std::chrono::nanoseconds ns) {
+        return ns.count() / 1000.0;
+    };
+    printf("======================================\n");
+    for (auto &[name, stats] : snapshot) {
+        for (auto [kind, pHistogram] : { std::make_pair("match", &stats.match), std::make_pair("parked", &stats.parked),
+                                         std::make_pair("task", &stats.task)
+                                       }) {
+            if (pHistogram->count == 0) continue;
+            printf("---%s\t%s\tcount:%llu\tmean:%.1fus\tp50:%.1fus\tp99:%.1fus\tmax:%.1fus---\n",
+                   name.c_str(), kind, static_cast<unsigned long long>(pHistogram->count),
+                   us(pHistogram->mean()), us(pHistogram->percentile(50)), us(pHistogram->percentile(99)),
+                   us(std::chrono::nanoseconds(pHistogram->max)));
+        }
+    }
+    printf("======================================\n");
+}
+
 struct Coordinator {
     std::mutex mMutex;
+    std::atomic<uint64_t> mSeq{0}; // odd while waiter snapshots are being republished
+
+    // quiescence accounting, every parked Select is also in flight
+    std::atomic<uint64_t> mEntered{0};
+    std::atomic<int64_t> mInFlight{0};
+    std::atomic<int64_t> mParked{0}; // only changed with mMutex held
+    std::atomic<int> mQuiescenceWaiters{0};
+    std::condition_variable mQuiescenceCv; // waited on with mMutex
+
+    void notifyQuiescence() {
+        if (mQuiescenceWaiters.load(std::memory_order_acquire) > 0) mQuiescenceCv.notify_all();
+    }
+
+    // called with mMutex held, after the waiting lists of chan2Case are changed
+    void publish(const std::map<Chan *, Case> &chan2Case) {
+        mSeq.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (auto &[pChan, _] : chan2Case) {
+            pChan->publishWaiters();
+        }
+        mSeq.fetch_add(1, std::memory_order_release);
+    }
+
+    // seqlock read of the published snapshots, retried while a publish overlaps.
+    // under constant churn it falls back to one pass under mMutex, so the
+    // result is always consistent across chans. must not be called with mMutex held
+    std::vector<std::shared_ptr<const WaiterSnapshot>> snapshot(const std::vector<Chan *> &chanVec) {
+        std::vector<std::shared_ptr<const WaiterSnapshot>> ret(chanVec.size());
+        for (int retry = 0; retry < 16; retry++) {
+            uint64_t seq = mSeq.load(std::memory_order_acquire);
+            for (size_t i = 0; i < chanVec.size(); i++) {
+                ret[i] = chanVec[i]->getWaiters();
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((seq & 1) == 0 && mSeq.load(std::memory_order_relaxed) == seq) {
+                return ret;
+            }
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (size_t i = 0; i < chanVec.size(); i++) {
+            ret[i] = chanVec[i]->getWaiters();
+        }
+        return ret;
+    }
 };
 Coordinator gCoordinator;
 
+// called with gCoordinator's lock and mMutex held, after a read made room:
+// the oldest parked writer's value joins the buffer so that FIFO order holds.
+// on a priority chan it is the oldest of the highest priority that has room
+bool Chan::admitWaitingWriter() {
+    Select *pSelect = nullptr;
+    Case *pCase = nullptr;
+    for (auto &[pWaiter, method] : waitingSelectList) {
+        if (method != WRITE) continue;
+        Case &case_ = pWaiter->mpChan2Case[this];
+        if (mpPriority && (mpPriority->size(case_.mPriority) >= static_cast<size_t>(mCapacity) ||
+                           (pCase && mpPriority->level(case_.mPriority) <= mpPriority->level(pCase->mPriority)))) {
+            continue;
+        }
+        pSelect = pWaiter;
+        pCase = &case_;
+        if (!mpPriority) break;
+    }
+    if (!pSelect) return false;
+    std::any val = pCase->mpFunc ? pCase->mpVal : std::move(pCase->mpVal);
+    if (mpPriority) {
+        mpPriority->push(pCase->mPriority, std::move(val));
+    } else {
+        mBuffer.push(std::move(val));
+    }
+    for (auto &pChan2CasePair : pSelect->mpChan2Case) {
+        Chan *pChan = pChan2CasePair.first;
+        pChan->waitingSelectList.remove_if(
+        [=](std::pair<Select *, METHOD> &a) {
+            return a.first == pSelect;
+        });
+    }
+    gCoordinator.publish(pSelect->mpChan2Case);
+    gCoordinator.mParked--;
+    LOG("%s admitted into %s's buffer\n", pSelect->mName.c_str(), mName.c_str());
+    {
+        std::unique_lock<std::mutex> lock(pSelect->mMutex);
+        pSelect->mpChanTobeNotified = this;
+        pSelect->mAdmitted = true;
+        // the admitted select returns right after its task, notify before it can go away
+        pSelect->mCv.notify_one();
+    }
+    return true;
+}
+
 void Case::exec(const Select *pSelect) {
     if (mMethod == READ) {
         mpChan->doRead(pSelect, mpVal);
     } else {
-        mpChan->doWrite(pSelect, mpVal);
+        mpChan->doWrite(pSelect, mpVal, !mpFunc);
     }
-    mpFunc(pSelect->mName, mpChan->mName, mpVal);
+    TRACE(TRACE_HANDOFF, pSelect->mName, mpChan->mName);
+    invoke(pSelect);
+}
+
+void Select::recordMatch(bool parked) const {
+    if (!mpLatency) return;
+    auto now = std::chrono::steady_clock::now();
+    mpLatency->match.record(now - mEnteredAt);
+    if (parked) mpLatency->parked.record(now - mParkedSince);
 }
 
 bool Case::tryExec(const Select *pSelect) {
@@ -204,14 +1255,35 @@ bool Case::tryExec(const Select *pSelect) {
     if (mMethod == READ) {
         flag = mpChan->tryRead(pSelect, mpVal);
     } else
-        flag = mpChan->tryWrite(pSelect, mpVal);
+        flag = mpChan->tryWrite(pSelect, mpVal, !mpFunc, mPriority);
     if (!flag) return false;
-    mpFunc(pSelect->mName, mpChan->mName, mpVal);
+    TRACE(TRACE_BUFFERED, pSelect->mName, mpChan->mName);
+    pSelect->recordMatch(false);
+    invoke(pSelect);
     return true;
 }
 
+void Case::invoke(const Select *pSelect) {
+    if (!mpFunc) return;
+    SelectLatency *pLatency = pSelect->mpLatency;
+    if (!mExecutor) {
+        auto start = pLatency ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+        mpFunc(pSelect->mName, mpChan->mName, mpVal);
+        if (pLatency) pLatency->task.record(std::chrono::steady_clock::now() - start);
+        return;
+    }
+    // the case is done with the value, hand it over to the executor
+    mExecutor([pFunc = std::move(mpFunc), selectName = pSelect->mName,
+    chanName = mpChan->mName, val = std::move(mpVal), pLatency]() {
+        auto start = pLatency ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+        pFunc(selectName, chanName, val);
+        if (pLatency) pLatency->task.record(std::chrono::steady_clock::now() - start);
+    });
+}
+
 template <typename... T> Select::Select(const std::string &name, T... caseVec) {
-    doSelect(name, {caseVec...});
+    std::array<Case, sizeof...(T)> cases{std::move(caseVec)...};
+    doSelect(name, std::make_move_iterator(cases.begin()), std::make_move_iterator(cases.end()));
 }
 
 Select::Select(std::initializer_list<Case> caseVec) {
@@ -232,12 +1304,29 @@ void Select::doSelect(const std::string &name,
     doSelect(name, caseVec.begin(), caseVec.end());
 }
 
+// keeps a Select counted as in flight until doSelect returns or throws
+struct InFlightGuard {
+    InFlightGuard() {
+        gCoordinator.mInFlight++;
+        gCoordinator.mEntered++;
+    }
+    ~InFlightGuard() {
+        gCoordinator.mInFlight--;
+        gCoordinator.notifyQuiescence();
+    }
+};
+
 template <typename T>
 void Select::doSelect(const std::string &name, T begin, T end) {
+    InFlightGuard inFlightGuard;
     this->mName = name;
+    if (gLatency.enabled()) {
+        mEnteredAt = std::chrono::steady_clock::now();
+        mpLatency = gLatency.get(name);
+    }
     bool hasDefault = false;
     for (auto it = begin; it != end; it++) {
-        auto &case_ = *it;
+        auto &&case_ = *it;
         if (case_.mpChan==nullptr) {
             if (it != end -1) throw std::runtime_error("default must be at the end");
             hasDefault = true;
@@ -246,12 +1335,14 @@ void Select::doSelect(const std::string &name, T begin, T end) {
         if (mpChan2Case.find(case_.mpChan) != mpChan2Case.end()) {
             throw std::runtime_error("duplicated chan in same select");
         }
-        mpChan2Case[case_.mpChan] = case_;
+        mpChan2Case[case_.mpChan] = std::forward<decltype(case_)>(case_);
     }
 
     Select *pSelect = nullptr;
     Case *pCase = nullptr;
     bool hasWaiter = false;
+    uint64_t traceFlow = 0;
+    TRACE(TRACE_SELECT, mName, std::string());
     {
         std::unique_lock<std::mutex> gLock(gCoordinator.mMutex);
         for (auto &pChan2CasePair : mpChan2Case) {
@@ -260,7 +1351,15 @@ void Select::doSelect(const std::string &name, T begin, T end) {
 
 
             if (pCase->mMethod == READ) {
-                if (!pChan->waitingSelectList.empty() &&
+                if (pChan->isBuffered() && !pChan->empty()) {
+                    // parked writers queue behind the buffer, read its head instead
+                    if (!pChan->waitingSelectList.empty() &&
+                            pChan->waitingSelectList.back().second == WRITE) {
+                        pCase->tryExec(this);
+                        LOG("%s non block\n", this->mName.c_str());
+                        return;
+                    }
+                } else if (!pChan->waitingSelectList.empty() &&
                         pChan->waitingSelectList.back().second == WRITE) {
                     pSelect = pChan->waitingSelectList.back()
                               .first; // remove blocked select
@@ -284,6 +1383,10 @@ void Select::doSelect(const std::string &name, T begin, T end) {
 
 
         if (hasWaiter) {
+            if (gTracer.enabled()) {
+                traceFlow = gTracer.nextFlow();
+                TRACE(TRACE_MATCH, mName, pCase->mpChan->mName, traceFlow);
+            }
             // de-register peer
 
             for (auto &pChan2CasePair : pSelect->mpChan2Case) {
@@ -294,6 +1397,8 @@ void Select::doSelect(const std::string &name, T begin, T end) {
                     return a.first == pSelect;
                 });
             }
+            gCoordinator.publish(pSelect->mpChan2Case);
+            gCoordinator.mParked--;
         }
 
 
@@ -312,6 +1417,7 @@ void Select::doSelect(const std::string &name, T begin, T end) {
             //not have buffered data
             if (hasDefault) return;
             // register self
+            mParkedSince = std::chrono::steady_clock::now();
             for (auto &pChan2CasePair : mpChan2Case) {
                 auto &case_ = pChan2CasePair.second;
                 LOG("%s add into %s's waiting list\n", this->mName.c_str(), case_.mpChan->mName.c_str());
@@ -320,7 +1426,12 @@ void Select::doSelect(const std::string &name, T begin, T end) {
                 } else {
                     case_.mpChan->waitingSelectList.emplace_back(this, WRITE);
                 }
+                TRACE(TRACE_REGISTER, mName, case_.mpChan->mName);
+                if (case_.mpChan->mpAdaptive) case_.mpChan->noteBlocked(case_.mMethod);
             }
+            gCoordinator.publish(mpChan2Case);
+            gCoordinator.mParked++;
+            gCoordinator.notifyQuiescence();
         }
 
     } // gLock
@@ -329,42 +1440,116 @@ void Select::doSelect(const std::string &name, T begin, T end) {
             std::unique_lock<std::mutex> lock(pSelect->mMutex);
             LOG("%s notify %s \n", this->mName.c_str(), pSelect->mName.c_str());
             pSelect->mpChanTobeNotified = pCase->mpChan;
+            pSelect->mTraceFlow = traceFlow;
+            // a woken writer may hand its payload over and return before we get
+            // further, so it must not be able to go away before the notify
+            pSelect->mCv.notify_one();
         }
-        pSelect->mCv.notify_one();
+        recordMatch(false);
         pCase->exec(this);
         return;
     }
 
 
 
+    TRACE(TRACE_PARK, mName, std::string());
     std::unique_lock<std::mutex> lock(mMutex);
     mCv.wait(lock, [=]() {
         return mpChanTobeNotified != nullptr;
     });
+    // nobody else touches this select once it is woken, and holding the lock
+    // below would order it before chan locks, against admitWaitingWriter
+    lock.unlock();
     LOG("%s notified\n", this->mName.c_str());
+    TRACE(TRACE_WAKE, mName, mpChanTobeNotified->mName, mTraceFlow);
+    if (mCancelled) throw Cancelled("select " + mName + " cancelled");
+    recordMatch(true);
+    for (auto &[pChan, case_] : mpChan2Case) {
+        if (pChan->mpAdaptive) {
+            pChan->noteParked(case_.mMethod, std::chrono::steady_clock::now() - mParkedSince);
+        }
+    }
+
+    if (mAdmitted) {
+        TRACE(TRACE_BUFFERED, mName, mpChanTobeNotified->mName);
+        mpChan2Case[mpChanTobeNotified].invoke(this);
+    } else {
+        mpChan2Case[mpChanTobeNotified].exec(this);
+    }
+}
+
+// number of Selects that have ever entered, a base for waitQuiescent's target
+uint64_t enteredSelects() {
+    return gCoordinator.mEntered.load();
+}
+
+// true once at least enteredTarget Selects have entered and every one still
+// running is parked, i.e. nothing can make progress without a new Select
+bool waitQuiescent(uint64_t enteredTarget, std::chrono::nanoseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock<std::mutex> gLock(gCoordinator.mMutex);
+    gCoordinator.mQuiescenceWaiters++;
+    // the in flight count drops outside the lock, so poll as well
+    bool ret = false;
+    while (!(ret = gCoordinator.mEntered >= enteredTarget &&
+                   gCoordinator.mInFlight == gCoordinator.mParked)) {
+        if (gCoordinator.mQuiescenceCv.wait_for(gLock, std::chrono::milliseconds(1)) == std::cv_status::timeout &&
+                std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+    }
+    gCoordinator.mQuiescenceWaiters--;
+    return ret;
+}
 
-    mpChan2Case[mpChanTobeNotified].exec(this);
+// de-registers every Select parked on chanVec, they throw Cancelled
+void cancel(const std::vector<Chan *> &chanVec) {
+    std::vector<std::pair<Select *, Chan *>> cancelled;
+    std::unique_lock<std::mutex> gLock(gCoordinator.mMutex);
+    for (Chan *pChan : chanVec) {
+        while (!pChan->waitingSelectList.empty()) {
+            Select *pSelect = pChan->waitingSelectList.front().first;
+            for (auto &pChan2CasePair : pSelect->mpChan2Case) {
+                pChan2CasePair.first->waitingSelectList.remove_if(
+                [=](std::pair<Select *, METHOD> &a) {
+                    return a.first == pSelect;
+                });
+            }
+            gCoordinator.publish(pSelect->mpChan2Case);
+            gCoordinator.mParked--;
+            cancelled.emplace_back(pSelect, pChan);
+        }
+    }
+    for (auto &[pSelect, pChan] : cancelled) {
+        {
+            std::unique_lock<std::mutex> lock(pSelect->mMutex);
+            pSelect->mpChanTobeNotified = pChan;
+            pSelect->mCancelled = true;
+            // the cancelled select throws and is destroyed as soon as it sees this
+            pSelect->mCv.notify_one();
+        }
+    }
 }
 
 Status watchStatus(const std::vector<Chan *> &chanVec) {
-    std::lock_guard<std::mutex>(gCoordinator.mMutex);
+    auto snapshot = gCoordinator.snapshot(chanVec);
     Status ret;
-    for (auto &pChan : chanVec) {
-        for (auto &[pSelect, method] : pChan->waitingSelectList) {
-            ret.emplace_back(pSelect, method, pChan);
+    for (size_t i = 0; i < chanVec.size(); i++) {
+        for (auto &waiter : *snapshot[i]) {
+            ret.emplace_back(waiter.pSelect, waiter.method, chanVec[i]);
         }
     }
     return ret;
 }
 
 NamedStatus watchNamedStatus(const std::vector<Chan *> &chanVec) {
-    std::lock_guard<std::mutex>(gCoordinator.mMutex);
+    auto snapshot = gCoordinator.snapshot(chanVec);
     NamedStatus ret;
-    for (auto &pChan : chanVec) {
-        for (auto &[pSelect, method] : pChan->waitingSelectList) {
-            LOG("%s found in %s's waiting list\n", pSelect->mName.c_str(),
-                pChan->mName.c_str());
-            ret.insert(make_tuple(pSelect->mName, method, pChan->mName));
+    for (size_t i = 0; i < chanVec.size(); i++) {
+        for (auto &waiter : *snapshot[i]) {
+            LOG("%s found in %s's waiting list\n", waiter.selectName.c_str(),
+                chanVec[i]->getName().c_str());
+            ret.insert(make_tuple(waiter.selectName, waiter.method, chanVec[i]->getName()));
         }
     }
     return ret;
@@ -396,4 +1581,220 @@ void printChannel(const std::vector<Channel::Chan *>& chanVec) {
     printf("======================================\n");
 }
 
+struct StallReport {
+    std::string selectName;
+    METHOD method;
+    std::string chanName;
+    std::chrono::nanoseconds blocked;
+};
+using WaitCycle = std::vector<std::tuple<std::string, METHOD, std::string>>;
+
+struct DetectorReport {
+    std::vector<StallReport> stalls;
+    std::vector<WaitCycle> cycles;
+    bool empty() const {
+        return stalls.empty() && cycles.empty();
+    }
+};
+
+// Builds the wait-for graph from the published waiter snapshots, so it never
+// contends with senders or receivers. The peers of a chan are the select names
+// seen blocked on its other side within the last kEndpointTtl stall thresholds
+// (or declared via addEndpoint), never the select's own name; a set of selects
+// blocked longer than stallThreshold whose every case only has stuck peers is
+// reported as deadlocked, one cycle per strongly connected component.
+class Detector {
+  public:
+    static constexpr int kEndpointTtl = 100;
+
+    Detector(const std::vector<Chan *> &chanVec, std::chrono::nanoseconds stallThreshold)
+        : mChanVec(chanVec), mStallThreshold(stallThreshold) {}
+
+    // checks every period on a background thread and reports non-empty results
+    Detector(const std::vector<Chan *> &chanVec, std::chrono::nanoseconds stallThreshold,
+             std::chrono::nanoseconds period, std::function<void(const DetectorReport &)> onReport)
+        : Detector(chanVec, stallThreshold) {
+        mThread = std::thread([=, this]() {
+            std::unique_lock<std::mutex> lock(mStopMutex);
+            while (!mCv.wait_for(lock, period, [this] { return mStop; })) {
+                DetectorReport report = check();
+                if (!report.empty()) onReport(report);
+            }
+        });
+    }
+    Detector(const Detector &) = delete;
+    Detector &operator=(const Detector &) = delete;
+
+    ~Detector() {
+        {
+            std::unique_lock<std::mutex> lock(mStopMutex);
+            mStop = true;
+        }
+        mCv.notify_all();
+        if (mThread.joinable()) mThread.join();
+    }
+
+    void addEndpoint(Chan *pChan, METHOD method, const std::string &selectName) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mDeclared[std::make_pair(pChan, method)].insert(selectName);
+    }
+
+    DetectorReport check() {
+        auto snapshot = gCoordinator.snapshot(mChanVec);
+        auto now = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mMutex);
+        DetectorReport report;
+
+        struct Node {
+            std::string name;
+            std::vector<std::pair<Chan *, METHOD>> cases;
+            bool stuck = false;
+        };
+        std::map<Select *, Node> nodes;
+        for (size_t i = 0; i < mChanVec.size(); i++) {
+            for (auto &waiter : *snapshot[i]) {
+                mLearned[std::make_pair(mChanVec[i], waiter.method)][waiter.selectName] = now;
+                auto blocked = std::chrono::duration_cast<std::chrono::nanoseconds>(now - waiter.since);
+                if (blocked < mStallThreshold) continue;
+                report.stalls.push_back(StallReport{waiter.selectName, waiter.method, mChanVec[i]->getName(), blocked});
+                Node &node = nodes[waiter.pSelect];
+                node.name = waiter.selectName;
+                node.cases.emplace_back(mChanVec[i], waiter.method);
+                node.stuck = true;
+            }
+        }
+
+        // forget learned endpoints not seen for a while, so names come and go
+        std::map<std::pair<Chan *, METHOD>, std::set<std::string>> endpoints = mDeclared;
+        for (auto it = mLearned.begin(); it != mLearned.end();) {
+            for (auto nameIt = it->second.begin(); nameIt != it->second.end();) {
+                if (now - nameIt->second > kEndpointTtl * mStallThreshold) {
+                    nameIt = it->second.erase(nameIt);
+                    continue;
+                }
+                endpoints[it->first].insert(nameIt->first);
+                nameIt++;
+            }
+            it = it->second.empty() ? mLearned.erase(it) : std::next(it);
+        }
+
+        // drop selects that may still be served by a peer not known to be stuck.
+        // a name seen on both sides of a chan (Chan::read and Chan::write both
+        // use the chan name) can't tell its instances apart, so it is no peer of itself
+        std::map<std::string, int> stuckNames;
+        for (auto &[_, node] : nodes) stuckNames[node.name]++;
+        auto peersOf = [&](const std::string &name, const std::pair<Chan *, METHOD> &case_) {
+            std::set<std::string> ret = endpoints[std::make_pair(case_.first, case_.second == READ ? WRITE : READ)];
+            ret.erase(name);
+            return ret;
+        };
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto &[_, node] : nodes) {
+                if (!node.stuck) continue;
+                for (auto &case_ : node.cases) {
+                    auto peers = peersOf(node.name, case_);
+                    bool servable = peers.empty();
+                    for (auto &peer : peers) {
+                        if (stuckNames[peer] == 0) servable = true;
+                    }
+                    if (servable) {
+                        node.stuck = false;
+                        stuckNames[node.name]--;
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // tarjan over the stuck selects, edges go to stuck peers
+        std::vector<Select *> stuck;
+        std::map<Select *, int> index;
+        for (auto &[pSelect, node] : nodes) {
+            if (node.stuck) {
+                index[pSelect] = static_cast<int>(stuck.size());
+                stuck.push_back(pSelect);
+            }
+        }
+        std::vector<std::vector<int>> edges(stuck.size());
+        for (size_t i = 0; i < stuck.size(); i++) {
+            for (auto &case_ : nodes[stuck[i]].cases) {
+                auto peers = peersOf(nodes[stuck[i]].name, case_);
+                for (size_t j = 0; j < stuck.size(); j++) {
+                    if (peers.count(nodes[stuck[j]].name)) edges[i].push_back(static_cast<int>(j));
+                }
+            }
+        }
+        std::vector<int> order(stuck.size(), -1), low(stuck.size()), stack;
+        std::vector<bool> onStack(stuck.size());
+        int counter = 0;
+        std::function<void(int)> connect = [&](int v) {
+            order[v] = low[v] = counter++;
+            stack.push_back(v);
+            onStack[v] = true;
+            for (int w : edges[v]) {
+                if (order[w] < 0) {
+                    connect(w);
+                    low[v] = std::min(low[v], low[w]);
+                } else if (onStack[w]) {
+                    low[v] = std::min(low[v], order[w]);
+                }
+            }
+            if (low[v] != order[v]) return;
+            std::vector<int> component;
+            int w;
+            do {
+                w = stack.back();
+                stack.pop_back();
+                onStack[w] = false;
+                component.push_back(w);
+            } while (w != v);
+            bool selfLoop = std::find(edges[v].begin(), edges[v].end(), v) != edges[v].end();
+            if (component.size() < 2 && !selfLoop) return;
+            WaitCycle cycle;
+            for (int u : component) {
+                for (auto &[pChan, method] : nodes[stuck[u]].cases) {
+                    cycle.emplace_back(nodes[stuck[u]].name, method, pChan->getName());
+                }
+            }
+            std::sort(cycle.begin(), cycle.end());
+            report.cycles.push_back(std::move(cycle));
+        };
+        for (size_t v = 0; v < stuck.size(); v++) {
+            if (order[v] < 0) connect(static_cast<int>(v));
+        }
+        return report;
+    }
+
+  private:
+    std::vector<Chan *> mChanVec;
+    std::chrono::nanoseconds mStallThreshold;
+    std::mutex mMutex; // protect mDeclared and mLearned
+    std::map<std::pair<Chan *, METHOD>, std::set<std::string>> mDeclared;
+    std::map<std::pair<Chan *, METHOD>, std::map<std::string, std::chrono::steady_clock::time_point>> mLearned; // last seen
+
+    std::mutex mStopMutex; // protect mStop
+    std::condition_variable mCv;
+    bool mStop{false};
+    std::thread mThread;
+};
+
+void printDetectorReport(const DetectorReport &report) {
+    printf("======================================\n");
+    for (auto &stall : report.stalls) {
+        printf("---stall\t%s\t%s\t%s\t%lldms---\n", stall.selectName.c_str(),
+               stall.method == METHOD::READ ? "read" : "write", stall.chanName.c_str(),
+               static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(stall.blocked).count()));
+    }
+    for (auto &cycle : report.cycles) {
+        printf("---deadlock---\n");
+        for (auto &[selectName, method, chanName] : cycle) {
+            printf("---%s\t%s\t%s---\n", selectName.c_str(),
+                   method == METHOD::READ ? "read" : "write", chanName.c_str());
+        }
+    }
+    printf("======================================\n");
+}
+
 } // namespace Channel
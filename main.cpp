@@ -1,4 +1,7 @@
 #include <channel.h>
+#include <pipeline.h>
+#include <sstream>
+#include <filesystem>
 using namespace std;
 
 
@@ -133,9 +136,203 @@ int testDefault() {
     return 0;
 }
 
+int testExecutor() {
+    Channel::Chan chan1{"chan1"};
+    std::atomic<bool> done{false};
+    //declared after done, so its pending callback runs before done is gone
+    Channel::ThreadPool pool(2);
+    std::thread t([&]() {
+        shared_ptr<int> a;
+        chan1.read(a, [&](const std::string& selectName, const std::string& chanName, const std::any& a) {
+            std::this_thread::sleep_for(100ms);
+            LOG("%s:read:%s:%d\n", selectName.c_str(), chanName.c_str(), *any_cast<shared_ptr<int>>(a));
+            done = true;
+            return true;
+        }, pool.executor());
+        //returns before the callback has run
+        printf("read returned, callback done:%s\n", done ? "yes" : "no");
+    });
+    chan1.write(make_shared<int>(40), taskWrite);
+    t.join();
+    return 0;
+}
+
+int testTrace() {
+    Channel::startTrace();
+    testNonBuffered();
+    testBuffered();
+    Channel::stopTrace();
+    std::ostringstream os;
+    Channel::dumpTrace(os);
+    printf("trace:%d bytes\n", static_cast<int>(os.str().size()));
+    return 0;
+}
+
+int testDetector() {
+    Channel::Chan chan1{"chan1"}, chan2{"chan2"};
+    std::vector<Channel::Chan*> chanVec{&chan1, &chan2};
+    Channel::Detector detector(chanVec, 10ms);
+    //A writes chan2 only after reading chan1, B the other way round
+    detector.addEndpoint(&chan2, Channel::WRITE, "A");
+    detector.addEndpoint(&chan1, Channel::WRITE, "B");
+    std::thread t([&]() {
+        shared_ptr<int> a;
+        Channel::Select{"A", Channel::Case{&chan1 >> a, taskRead}};
+    });
+    std::thread t2([&]() {
+        shared_ptr<int> b;
+        Channel::Select{"B", Channel::Case{&chan2 >> b, taskRead}};
+    });
+    std::this_thread::sleep_for(100ms);
+    printDetectorReport(detector.check());
+    chan1.write(make_shared<int>(50), taskWrite);
+    chan2.write(make_shared<int>(60), taskWrite);
+    t.join();
+    t2.join();
+    return 0;
+}
+
+int testCancel() {
+    Channel::Chan chan1{"chan1"};
+    uint64_t entered = Channel::enteredSelects();
+    std::thread t([&]() {
+        try {
+            shared_ptr<int> a;
+            Channel::Select{"reader", Channel::Case{&chan1 >> a, taskRead}};
+        } catch (const Channel::Cancelled &e) {
+            printf("%s\n", e.what());
+        }
+    });
+    Channel::waitQuiescent(entered + 1, 1s);
+    Channel::cancel({&chan1});
+    t.join();
+    return 0;
+}
+
+int testSpill() {
+    Channel::SpillConfig config{std::filesystem::temp_directory_path(), Channel::trivialSerializer<int>(), 64};
+    Channel::Chan schan1{2, config, "schan1"};
+    for (int i = 0; i < 20; i++) {
+        schan1.write(i, [](const std::string& selectName, const std::string& chanName, const std::any& a) {
+            LOG("%s:write:%s:%d\n", selectName.c_str(), chanName.c_str(), any_cast<int>(a));
+            return true;
+        });
+    }
+    printf("spilled:%d\n", static_cast<int>(schan1.getSpilled()));
+    for (int i = 0; i < 20; i++) {
+        schan1.read(0, [](const std::string& selectName, const std::string& chanName, const std::any& a) {
+            printf("%d ", any_cast<int>(a));
+            return true;
+        });
+    }
+    printf("\nspilled:%d\n", static_cast<int>(schan1.getSpilled()));
+    return 0;
+}
+
+int testAdaptive() {
+    Channel::Chan achan1{Channel::AdaptiveConfig{1, 64, 10ms}, "achan1"};
+    std::thread t([&]() {
+        for (int i = 0; i < 200; i++) {
+            achan1.write(make_shared<int>(i), taskWrite);
+        }
+    });
+    std::thread t2([&]() {
+        shared_ptr<int> a;
+        for (int i = 0; i < 200; i++) {
+            std::this_thread::sleep_for(1ms);
+            achan1.read(a, taskRead);
+        }
+    });
+    t.join();
+    t2.join();
+    for (auto &event : achan1.getResizeHistory()) {
+        printf("resized %d->%d\n", event.from, event.to);
+    }
+    printf("capacity:%d\n", static_cast<int>(achan1.getCapacity()));
+    //idle windows shrink it back once it is looked at
+    std::this_thread::sleep_for(100ms);
+    printf("capacity after idle:%d\n", static_cast<int>(achan1.getCapacity()));
+    return 0;
+}
+
+int testPipeline() {
+    namespace Pipeline = Channel::Pipeline;
+    Channel::Chan in{4, "in"}, mapped{4, "mapped"}, filtered{4, "filtered"}, scaled{4, "scaled"}, out{"out"};
+    Pipeline::Stage plusOne = Pipeline::map(&in, &mapped, [](std::any a) -> std::any {
+        return any_cast<int>(a) + 1;
+    });
+    Pipeline::Stage even = Pipeline::filter(&mapped, &filtered, [](const std::any& a) {
+        return any_cast<int>(a) % 2 == 0;
+    });
+    Pipeline::Stage times10 = Pipeline::parallelMap(&filtered, &scaled, 4, [](std::any a) -> std::any {
+        return any_cast<int>(a) * 10;
+    }, true);
+    Pipeline::Stage batch = Pipeline::batch(&scaled, &out, 3, 5ms);
+    std::thread t([&]() {
+        for (int i = 0; i < 20; i++) {
+            Pipeline::send(&in, i);
+        }
+        Pipeline::close(&in);
+    });
+    for (std::any a = Pipeline::recv(&out); !Pipeline::isEnd(a); a = Pipeline::recv(&out)) {
+        for (std::any& b : any_cast<Pipeline::Batch&>(a)) {
+            printf("%d ", any_cast<int>(b));
+        }
+        printf("| ");
+    }
+    printf("\n");
+    t.join();
+    return 0;
+}
+
+int testPriority() {
+    Channel::Chan pchan1{2, Channel::PriorityConfig{2, 1s}, "pchan1"};
+    //bulk level is full, control still gets in and goes out first
+    pchan1.write(make_shared<int>(1), taskWrite, 0);
+    pchan1.write(make_shared<int>(2), taskWrite, 0);
+    pchan1.write(make_shared<int>(100), taskWrite, 1);
+    shared_ptr<int> a;
+    for (int i = 0; i < 3; i++) {
+        pchan1.read(a, [](const std::string& selectName, const std::string& chanName, const std::any& a) {
+            printf("%d ", *any_cast<shared_ptr<int>>(a));
+            return true;
+        });
+    }
+    printf("\n");
+    return 0;
+}
+
+int testLatency() {
+    Channel::startLatency();
+    Channel::Chan chan1{"chan1"};
+    std::thread t([&]() {
+        for (int i = 0; i < 100; i++) {
+            std::this_thread::sleep_for(100us);
+            Channel::Select{"producer", Channel::Case{&chan1 << make_shared<int>(i), taskWrite}};
+        }
+    });
+    for (int i = 0; i < 100; i++) {
+        shared_ptr<int> a;
+        Channel::Select{"consumer", Channel::Case{&chan1 >> a, taskRead}};
+    }
+    t.join();
+    Channel::stopLatency();
+    printLatencySnapshot(Channel::latencySnapshot(true));
+    return 0;
+}
+
 int main() {
     testNonBuffered();
     testBuffered();
     testDefault();
+    testExecutor();
+    testTrace();
+    testDetector();
+    testCancel();
+    testSpill();
+    testAdaptive();
+    testPipeline();
+    testPriority();
+    testLatency();
     return 0;
 }
\ No newline at end of file
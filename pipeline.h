@@ -0,0 +1,236 @@
+#pragma once
+
+#include <channel.h>
+
+namespace Channel {
+namespace Pipeline {
+
+// written after the last value, every stage forwards it and exits
+struct EndOfStream {};
+
+using Batch = std::vector<std::any>;
+
+bool isEnd(const std::any &val) {
+    return val.type() == typeid(EndOfStream);
+}
+
+// blocking write, the value is moved into the chan
+void send(Chan *pChan, std::any val) {
+    pChan->write(std::move(val), nullptr);
+}
+
+// blocking read, the value is moved out of the case once it is delivered
+std::any recv(Chan *pChan) {
+    std::any ret;
+    pChan->read(std::any{}, [&](const std::string &, const std::string &, const std::any & a) {
+        ret = std::move(const_cast<std::any &>(a));
+        return true;
+    });
+    return ret;
+}
+
+// non-blocking read, false when no value is ready
+bool tryRecv(Chan *pChan, std::any &val) {
+    bool got = false;
+    Select{
+        pChan->getName(),
+        Case{
+            pChan >> std::any{}, [&](const std::string &, const std::string &, const std::any & a)
+            {
+                val = std::move(const_cast<std::any &>(a));
+                got = true;
+                return true;
+            }
+        },
+        Default{}
+    };
+    return got;
+}
+
+void close(Chan *pChan) {
+    send(pChan, EndOfStream{});
+}
+
+// most values a stage moves through one internal channel operation
+constexpr size_t kMaxChunk = 64;
+
+// owns the threads and internal chans of a stage, joins them on destruction
+class Stage {
+  public:
+    Stage() = default;
+    Stage(Stage &&) = default;
+    // the running threads of this stage are joined before it takes over other's
+    Stage &operator=(Stage &&other) {
+        if (this != &other) {
+            join();
+            mThreads = std::move(other.mThreads);
+            mChans = std::move(other.mChans);
+        }
+        return *this;
+    }
+
+    ~Stage() {
+        join();
+    }
+
+    void join() {
+        for (auto &t : mThreads) {
+            if (t.joinable()) t.join();
+        }
+    }
+
+  private:
+    friend Stage map(Chan *, Chan *, std::function<std::any(std::any)>);
+    friend Stage filter(Chan *, Chan *, std::function<bool(const std::any &)>);
+    friend Stage batch(Chan *, Chan *, size_t, std::chrono::nanoseconds);
+    friend Stage parallelMap(Chan *, Chan *, size_t, std::function<std::any(std::any)>, bool);
+
+    std::vector<std::unique_ptr<Chan>> mChans;
+    std::vector<std::thread> mThreads;
+};
+
+Stage map(Chan *pIn, Chan *pOut, std::function<std::any(std::any)> fun) {
+    Stage stage;
+    stage.mThreads.emplace_back([ = ]() {
+        for (std::any val = recv(pIn); !isEnd(val); val = recv(pIn)) {
+            send(pOut, fun(std::move(val)));
+        }
+        close(pOut);
+    });
+    return stage;
+}
+
+Stage filter(Chan *pIn, Chan *pOut, std::function<bool(const std::any &)> pred) {
+    Stage stage;
+    stage.mThreads.emplace_back([ = ]() {
+        for (std::any val = recv(pIn); !isEnd(val); val = recv(pIn)) {
+            if (pred(val)) send(pOut, std::move(val));
+        }
+        close(pOut);
+    });
+    return stage;
+}
+
+// emits a Batch once count values are collected, or on the first tick of
+// interval with a partial batch pending, so downstream does one channel
+// operation per batch
+Stage batch(Chan *pIn, Chan *pOut, size_t count, std::chrono::nanoseconds interval) {
+    Stage stage;
+    Chan *pTick = stage.mChans.emplace_back(new Chan{1, "tick"}).get();
+    auto pStop = std::make_shared<std::atomic<bool>>(false);
+    stage.mThreads.emplace_back([ = ]() {
+        while (!*pStop) {
+            std::this_thread::sleep_for(interval);
+            Select{"ticker", Case{pTick << std::any(true), nullptr}, Default{}};
+        }
+    });
+    stage.mThreads.emplace_back([ = ]() {
+        Batch pending;
+        auto flush = [&]() {
+            if (pending.empty()) return;
+            send(pOut, std::move(pending));
+            pending = Batch{};
+        };
+        while (true) {
+            // tasks may run under the coordinator lock, so only stash the value there
+            std::any val;
+            Select{
+                "batch",
+                Case{
+                    pIn >> std::any{}, [&](const std::string &, const std::string &, const std::any & a)
+                    {
+                        val = std::move(const_cast<std::any &>(a));
+                        return true;
+                    }
+                },
+                Case{pTick >> std::any{}, nullptr}
+            };
+            if (!val.has_value()) {
+                flush();
+                continue;
+            }
+            if (isEnd(val)) break;
+            pending.push_back(std::move(val));
+            if (pending.size() >= count) flush();
+        }
+        flush();
+        *pStop = true;
+        close(pOut);
+    });
+    return stage;
+}
+
+// runs fun on workerNum threads; when ordered, results leave in input order.
+// values already waiting on pIn travel to the workers and back in chunks of up
+// to kMaxChunk, one channel operation per chunk and hop. when ordered, at most
+// 4 * workerNum chunks are dispatched ahead of the oldest one not yet emitted,
+// so a slow value bounds the reorder buffer instead of letting it grow
+Stage parallelMap(Chan *pIn, Chan *pOut, size_t workerNum,
+                  std::function<std::any(std::any)> fun, bool ordered) {
+    using Chunk = std::pair<uint64_t, Batch>;
+    Stage stage;
+    int capacity = static_cast<int>(workerNum);
+    Chan *pWork = stage.mChans.emplace_back(new Chan{capacity, "work"}).get();
+    Chan *pDone = stage.mChans.emplace_back(new Chan{capacity, "done"}).get();
+    // one token per chunk in flight, taken back once it is emitted in order
+    Chan *pCredit = stage.mChans.emplace_back(new Chan{4 * capacity, "credit"}).get();
+    stage.mThreads.emplace_back([ = ]() {
+        uint64_t seq = 0;
+        for (bool end = false; !end;) {
+            Batch values;
+            std::any val = recv(pIn);
+            do {
+                if (isEnd(val)) {
+                    end = true;
+                    break;
+                }
+                values.push_back(std::move(val));
+            } while (values.size() < kMaxChunk && tryRecv(pIn, val));
+            if (values.empty()) continue;
+            if (ordered) send(pCredit, true);
+            send(pWork, Chunk{seq++, std::move(values)});
+        }
+        for (size_t i = 0; i < workerNum; i++) {
+            close(pWork);
+        }
+    });
+    for (size_t i = 0; i < workerNum; i++) {
+        stage.mThreads.emplace_back([ = ]() {
+            for (std::any val = recv(pWork); !isEnd(val); val = recv(pWork)) {
+                for (std::any &value : std::any_cast<Chunk &>(val).second) {
+                    value = fun(std::move(value));
+                }
+                send(pDone, std::move(val));
+            }
+            close(pDone);
+        });
+    }
+    stage.mThreads.emplace_back([ = ]() {
+        // chunks hold consecutive values, so ordering chunks orders values
+        std::map<uint64_t, Batch> reorder;
+        uint64_t next = 0;
+        for (size_t ended = 0; ended < workerNum;) {
+            std::any val = recv(pDone);
+            if (isEnd(val)) {
+                ended++;
+                continue;
+            }
+            Chunk &chunk = std::any_cast<Chunk &>(val);
+            if (!ordered) {
+                for (std::any &value : chunk.second) send(pOut, std::move(value));
+                continue;
+            }
+            reorder.emplace(chunk.first, std::move(chunk.second));
+            for (auto it = reorder.begin(); it != reorder.end() && it->first == next; it = reorder.erase(it)) {
+                for (std::any &value : it->second) send(pOut, std::move(value));
+                recv(pCredit);
+                next++;
+            }
+        }
+        close(pOut);
+    });
+    return stage;
+}
+
+} // namespace Pipeline
+} // namespace Channel
@@ -1,7 +1,12 @@
 #include <channel.h>
+#include <pipeline.h>
+#include <cassert>
 #include <random>
 #include <set>
 #include <functional>
+#include <optional>
+#include <unordered_set>
+#include <filesystem>
 
 //std::random_device seed;
 //std::mt19937 engine(seed());
@@ -27,13 +32,9 @@ bool sampleBernoulli(std::mt19937& engine) {
     return uniformReal(engine) > 0.5;
 }
 
-std::chrono::microseconds sleepTimeSum = std::chrono::microseconds{};
 std::chrono::microseconds sampleSleep(std::mt19937 &engine) {
     std::uniform_int_distribution<> uniformDist(0, 5);
-    std::chrono::microseconds sleepTime= chrono::microseconds(uniformDist(engine) * 100);
-    sleepTimeSum += sleepTime;
-    std::chrono::microseconds ret = sleepTime;
-    return ret;
+    return chrono::microseconds(uniformDist(engine) * 100);
 }
 
 using CaseInstance = tuple<microseconds, ::Channel::METHOD, Channel::Chan *, std::shared_ptr<int>>;
@@ -59,9 +60,9 @@ SelectInstance sampleSelect(std::mt19937& engine, const std::string& name, const
 
 }
 
-TestCase sampleTestCase (std::mt19937& engine, const std::vector<Channel::Chan*>& chanVec) {
+TestCase sampleTestCase (std::mt19937& engine, const std::vector<Channel::Chan*>& chanVec, int maxSelect) {
     TestCase ret;
-    std::uniform_int_distribution<> uniformDist(1, 6);
+    std::uniform_int_distribution<> uniformDist(1, maxSelect);
     int selectNum = uniformDist(engine);
     std::chrono::microseconds accSleepTime(0s);
     for (int i = 0; i < selectNum; i++) {
@@ -284,6 +285,291 @@ set<Channel::NamedStatus> emulate(const TestCase &selectInstances,
     return results;
 }
 
+// Selects with identical cases are interchangeable, so they are grouped into
+// classes and a state only records, per class, how many members ran (c) and
+// how many of those are still blocked (b), plus every chan's queue size:
+// {c0, b0, c1, b1, ..., q0, q1, ...}. A result is the b of every class.
+using ExploreState = string;
+
+struct ExploreModel {
+    vector<vector<int>> classMembers; // select positions, in start order
+    vector<vector<pair<int, Channel::METHOD>>> classCases; // chan position and method
+    vector<vector<int>> classMethod; // method per chan position, -1 if absent
+    vector<bool> classDefault;
+    vector<uint64_t> classChanMask;
+    vector<vector<int>> classPeers; // classes that can release a blocked member
+    vector<int> capacity;
+    map<string, int> selectPos;
+    vector<int> selectClass;
+};
+
+ExploreModel buildModel(const TestCase &testCase, const vector<Channel::Chan *> &chanVec) {
+    ExploreModel model;
+    map<Channel::Chan *, int> chanPos;
+    for (int i = 0; i < chanVec.size(); i++) {
+        chanPos[chanVec[i]] = i;
+        model.capacity.push_back(static_cast<int>(chanVec[i]->getCapacity()));
+    }
+    map<pair<vector<pair<int, Channel::METHOD>>, bool>, int> signature2Class;
+    for (int i = 0; i < testCase.size(); i++) {
+        const SelectInstance &selectInstance = testCase[i].second;
+        vector<pair<int, Channel::METHOD>> cases;
+        for (auto &[_, method, pChan, __] : get<1>(selectInstance)) {
+            cases.emplace_back(chanPos[pChan], method);
+        }
+        sort(cases.begin(), cases.end());
+        auto signature = make_pair(cases, get<2>(selectInstance));
+        auto it = signature2Class.find(signature);
+        if (it == signature2Class.end()) {
+            it = signature2Class.emplace(signature, model.classMembers.size()).first;
+            model.classMembers.emplace_back();
+            model.classCases.push_back(cases);
+            model.classMethod.emplace_back(chanVec.size(), -1);
+            model.classChanMask.push_back(0);
+            for (auto &[chan, method] : cases) {
+                model.classMethod.back()[chan] = method;
+                model.classChanMask.back() |= uint64_t(1) << chan;
+            }
+            model.classDefault.push_back(get<2>(selectInstance));
+        }
+        model.classMembers[it->second].push_back(i);
+        model.selectPos[get<0>(selectInstance)] = i;
+        model.selectClass.push_back(it->second);
+    }
+    for (int k = 0; k < model.classMembers.size(); k++) {
+        model.classPeers.emplace_back();
+        for (int j = 0; j < model.classMembers.size(); j++) {
+            for (auto &[chan, method] : model.classCases[k]) {
+                if (model.classMethod[j][chan] >= 0 && model.classMethod[j][chan] != method) {
+                    model.classPeers[k].push_back(j);
+                    break;
+                }
+            }
+        }
+    }
+    return model;
+}
+
+ExploreState initialState(const ExploreModel &model) {
+    return ExploreState(model.classMembers.size() * 2 + model.capacity.size(), 0);
+}
+
+// successors in the order worth trying first: selects in start order. A pending
+// class that shares no chan with any other live class commutes with every other
+// step, so when there is one it is the only successor taken (persistent set)
+void exploreSuccessors(const ExploreModel &model, const ExploreState &state, vector<ExploreState> &out) {
+    int classNum = static_cast<int>(model.classMembers.size());
+    auto c = [&](int k) {
+        return static_cast<int>(static_cast<uint8_t>(state[2 * k]));
+    };
+    auto b = [&](int k) {
+        return static_cast<int>(static_cast<uint8_t>(state[2 * k + 1]));
+    };
+    vector<int> pending;
+    for (int k = 0; k < classNum; k++) {
+        if (c(k) < model.classMembers[k].size()) pending.push_back(k);
+    }
+    sort(pending.begin(), pending.end(), [&](int x, int y) {
+        return model.classMembers[x][c(x)] < model.classMembers[y][c(y)];
+    });
+    for (int k : pending) {
+        bool independent = true;
+        for (int j = 0; j < classNum && independent; j++) {
+            bool live = c(j) < model.classMembers[j].size() || b(j) > 0;
+            if (j != k && live && (model.classChanMask[j] & model.classChanMask[k])) independent = false;
+        }
+        if (independent) {
+            pending = {k};
+            break;
+        }
+    }
+    for (int k : pending) {
+        bool matched = false;
+        for (auto &[chan, method] : model.classCases[k]) {
+            int needMethod = (method == Channel::METHOD::READ) ? Channel::METHOD::WRITE : Channel::METHOD::READ;
+            for (int j = 0; j < classNum; j++) {
+                if (b(j) == 0 || model.classMethod[j][chan] != needMethod) continue;
+                ExploreState next = state;
+                next[2 * k]++;
+                next[2 * j + 1]--;
+                out.push_back(std::move(next));
+                matched = true;
+            }
+        }
+        if (matched) continue;
+        bool buffered = false;
+        for (auto &[chan, method] : model.classCases[k]) {
+            int qsize = static_cast<uint8_t>(state[2 * classNum + chan]);
+            if ((method == Channel::METHOD::READ && qsize > 0) ||
+                    (method == Channel::METHOD::WRITE && qsize < model.capacity[chan])) {
+                ExploreState next = state;
+                next[2 * k]++;
+                next[2 * classNum + chan] += (method == Channel::METHOD::READ) ? -1 : 1;
+                out.push_back(std::move(next));
+                buffered = true;
+            }
+        }
+        if (buffered) continue;
+        ExploreState next = state;
+        next[2 * k]++;
+        if (!model.classDefault[k]) next[2 * k + 1]++;
+        out.push_back(std::move(next));
+    }
+}
+
+struct ExploreResult {
+    set<ExploreState> results;
+    bool found = false;
+    size_t states = 0;
+};
+
+class VisitedSet {
+  public:
+    bool insert(const ExploreState &state) {
+        Shard &shard = mShards[std::hash<ExploreState> {}(state) % kShards];
+        lock_guard<mutex> lock(shard.mMutex);
+        return shard.mStates.insert(state).second;
+    }
+    size_t size() {
+        size_t ret = 0;
+        for (Shard &shard : mShards) {
+            lock_guard<mutex> lock(shard.mMutex);
+            ret += shard.mStates.size();
+        }
+        return ret;
+    }
+
+  private:
+    static constexpr size_t kShards = 64;
+    struct Shard {
+        mutex mMutex;
+        unordered_set<ExploreState> mStates;
+    };
+    Shard mShards[kShards];
+};
+
+// Parallel depth-first search over memoized states, every state is expanded
+// once. Workers keep a local stack and hand half of it to the shared pool
+// while somebody is idle. With pTarget it only answers whether that result
+// is reachable, prunes states that already completed too many members of a
+// class, and stops at the first hit; otherwise it collects every result.
+ExploreResult explore(const ExploreModel &model, const ExploreState *pTarget,
+                      size_t threadNum = std::max(1u, std::thread::hardware_concurrency())) {
+    int classNum = static_cast<int>(model.classMembers.size());
+    ExploreResult ret;
+    VisitedSet visited;
+    mutex poolMutex; // protect pool, idle and ret.results
+    condition_variable poolCv;
+    vector<ExploreState> pool{initialState(model)};
+    visited.insert(pool.back());
+    size_t idle = 0;
+    atomic<size_t> idleHint{0};
+    atomic<bool> found{false};
+
+    // members never block again once completed, and blocked members beyond
+    // the target need a pending peer each to release them
+    auto pruned = [&](const ExploreState &state) {
+        if (!pTarget) return false;
+        for (int k = 0; k < classNum; k++) {
+            int c = static_cast<uint8_t>(state[2 * k]);
+            int b = static_cast<uint8_t>(state[2 * k + 1]);
+            int target = static_cast<uint8_t>((*pTarget)[k]);
+            if (c - b > static_cast<int>(model.classMembers[k].size()) - target) return true;
+            if (b <= target) continue;
+            int releasers = 0;
+            for (int j : model.classPeers[k]) {
+                releasers += static_cast<int>(model.classMembers[j].size()) - static_cast<uint8_t>(state[2 * j]);
+            }
+            if (b - target > releasers) return true;
+        }
+        return false;
+    };
+    auto terminal = [&](const ExploreState &state) {
+        for (int k = 0; k < classNum; k++) {
+            if (static_cast<uint8_t>(state[2 * k]) < model.classMembers[k].size()) return false;
+        }
+        ExploreState result(classNum, 0);
+        for (int k = 0; k < classNum; k++) {
+            result[k] = state[2 * k + 1];
+        }
+        if (pTarget) {
+            if (result == *pTarget) found = true;
+        } else {
+            lock_guard<mutex> lock(poolMutex);
+            ret.results.insert(result);
+        }
+        return true;
+    };
+
+    auto worker = [&]() {
+        vector<ExploreState> local, next;
+        for (size_t step = 0; ; step++) {
+            if (local.empty()) {
+                unique_lock<mutex> lock(poolMutex);
+                idle++;
+                idleHint = idle;
+                poolCv.notify_all();
+                poolCv.wait(lock, [&] {
+                    return !pool.empty() || idle == threadNum || found;
+                });
+                if (pool.empty() || found) return;
+                idle--;
+                idleHint = idle;
+                local.push_back(std::move(pool.back()));
+                pool.pop_back();
+            }
+            ExploreState state = std::move(local.back());
+            local.pop_back();
+            if (found) continue;
+            if (terminal(state)) continue;
+            next.clear();
+            exploreSuccessors(model, state, next);
+            for (auto it = next.rbegin(); it != next.rend(); it++) {
+                if (!pruned(*it) && visited.insert(*it)) local.push_back(std::move(*it));
+            }
+            if (step % 64 == 0 && idleHint > 0 && local.size() > 1) {
+                lock_guard<mutex> lock(poolMutex);
+                size_t half = local.size() / 2;
+                std::move(local.begin(), local.begin() + half, back_inserter(pool));
+                local.erase(local.begin(), local.begin() + half);
+                poolCv.notify_all();
+            }
+        }
+    };
+    vector<thread> threads;
+    for (size_t i = 0; i < threadNum; i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    ret.found = found;
+    ret.states = visited.size();
+    return ret;
+}
+
+// the result of a status, nullopt if it is not what any set of blocked selects shows
+std::optional<ExploreState> canonicalize(const ExploreModel &model, const TestCase &testCase,
+        const Channel::NamedStatus &status) {
+    set<int> blocked;
+    for (auto &[selectName, _, __] : status) {
+        auto it = model.selectPos.find(selectName);
+        if (it == model.selectPos.end()) return std::nullopt;
+        blocked.insert(it->second);
+    }
+    Channel::NamedStatus expected;
+    ExploreState ret(model.classMembers.size(), 0);
+    for (int selectPos : blocked) {
+        ret[model.selectClass[selectPos]]++;
+        const SelectInstance &selectInstance = testCase[selectPos].second;
+        for (auto &[_, method, pChan, __] : get<1>(selectInstance)) {
+            expected.insert(make_tuple(get<0>(selectInstance), method, pChan->getName()));
+        }
+    }
+    if (expected != status) return std::nullopt;
+    return ret;
+}
+
 void printTestCase(TestCase& testCase) {
     for (auto& [selectSleepTime, selectInstance] : testCase) {
         bool isDefault = get<2>(selectInstance);
@@ -309,9 +595,9 @@ auto taskFun = [](const microseconds &sleepTime, Channel::METHOD method) -> Chan
     return retFun;
 };
 
-Channel::NamedStatus executeTestCase(const vector<Channel::Chan *> &chanVec, const TestCase& testCase) {
-    vector<unique_ptr<thread>> threadPool;
-    sleepTimeSum = std::chrono::microseconds{}; //reset sleep time sum
+std::optional<Channel::NamedStatus> executeTestCase(const vector<Channel::Chan *> &chanVec, const TestCase& testCase) {
+    vector<thread> threadPool;
+    uint64_t enteredTarget = Channel::enteredSelects() + testCase.size();
     for (auto &[selectSleepTime, selectInstance] : testCase) {
         std::vector<Channel::Case> caseVec;
         string selectName = get<0>(selectInstance);
@@ -326,19 +612,25 @@ Channel::NamedStatus executeTestCase(const vector<Channel::Chan *> &chanVec, con
         auto threadFun = [](string selectName, std::vector<Channel::Case> caseVec, microseconds selectSleepTime) {
             this_thread::sleep_for(selectSleepTime);
             printf("%s start\n", selectName.c_str());
-            Channel::Select(selectName, caseVec.begin(), caseVec.end());
+            try {
+                Channel::Select(selectName, caseVec.begin(), caseVec.end());
+            } catch (const Channel::Cancelled &) {
+            }
         };
-        threadPool.emplace_back(new thread(threadFun, selectName, caseVec, selectSleepTime));
+        threadPool.emplace_back(threadFun, selectName, caseVec, selectSleepTime);
+    }
+    std::optional<Channel::NamedStatus> ret;
+    if (Channel::waitQuiescent(enteredTarget, 10s)) {
+        ret = Channel::watchNamedStatus(chanVec);
     }
-    this_thread::sleep_for(sleepTimeSum + 1s); //make sure thread has reached a stable state
-    Channel::NamedStatus namedStatus = Channel::watchNamedStatus(chanVec);
+    Channel::cancel(chanVec); //release the selects left parked
     for (auto &t : threadPool) {
-        t->detach();
+        t.join();
     }
-    return namedStatus;
+    return ret;
 }
 
-void testcase(std::mt19937& engine) {
+bool testcase(std::mt19937& engine, int maxSelect) {
     std::vector<ChanPtr> chans = sampleChan(engine);
     std::vector<Channel::Chan *> chanVec;
     transform(chans.begin(), chans.end(), std::back_inserter(chanVec), [](auto &c) {
@@ -346,28 +638,520 @@ void testcase(std::mt19937& engine) {
     });
     printChannel(chanVec);
 
-    TestCase testCase = sampleTestCase(engine, chanVec);
+    TestCase testCase = sampleTestCase(engine, chanVec, maxSelect);
     printTestCase(testCase);
+    ExploreModel model = buildModel(testCase, chanVec);
 
-    set<Channel::NamedStatus> emulateResult = emulate(testCase, chanVec);
-    std::cout << "Select num:" << testCase.size()
-              << " result size:" << emulateResult.size() << std::endl;
-    cout << "expected results:" << endl;
-    for (auto &i : emulateResult) {
-        printNamedStatus(i);
+    if (testCase.size() <= 6) {
+        //cross check the explorer against the exhaustive emulator
+        set<Channel::NamedStatus> emulateResult = emulate(testCase, chanVec);
+        std::cout << "Select num:" << testCase.size()
+                  << " result size:" << emulateResult.size() << std::endl;
+        cout << "expected results:" << endl;
+        set<ExploreState> emulateCanonical;
+        for (auto &i : emulateResult) {
+            printNamedStatus(i);
+            emulateCanonical.insert(*canonicalize(model, testCase, i));
+        }
+        if (explore(model, nullptr).results != emulateCanonical) {
+            cout << "explorer disagrees with emulator" << endl;
+            return false;
+        }
     }
 
-    Channel::NamedStatus runResult = executeTestCase(chanVec, testCase);
+    std::optional<Channel::NamedStatus> runResult = executeTestCase(chanVec, testCase);
+    if (!runResult) {
+        cout << "selects never became quiescent" << endl;
+        return false;
+    }
     cout << "got result:" << endl;
-    printNamedStatus(runResult);
+    printNamedStatus(*runResult);
+
+    auto start = steady_clock::now();
+    std::optional<ExploreState> target = canonicalize(model, testCase, *runResult);
+    ExploreResult exploreResult = target ? explore(model, &*target) : ExploreResult{};
+    cout << "Select num:" << testCase.size() << " class num:" << model.classMembers.size()
+         << " explored states:" << exploreResult.states << " in "
+         << duration_cast<milliseconds>(steady_clock::now() - start).count() << "ms" << endl;
+    if (!exploreResult.found) {
+        cout << "unreachable result" << endl;
+        return false;
+    }
+    return true;
+}
+int readInt(Channel::Chan &chan) {
+    int ret = -1;
+    chan.read(any{}, [&](const std::string &, const std::string &, const any & a) {
+        ret = any_cast<int>(a);
+        return true;
+    });
+    return ret;
+}
+
+bool expectOrder(const string &what, const vector<int> &got, const vector<int> &expected) {
+    if (got == expected) return true;
+    cout << what << " out of order:";
+    for (int i : got) cout << " " << i;
+    cout << endl;
+    return false;
+}
+
+//values spilled to disk come back after the buffered ones, in write order
+bool checkSpillOrder() {
+    Channel::SpillConfig config{std::filesystem::temp_directory_path(), Channel::trivialSerializer<int>(), 256};
+    Channel::Chan chan{2, config, "spillOrder"};
+    vector<int> got, expected;
+    for (int i = 0; i < 1000; i++) chan.write(i, nullptr);
+    if (chan.getSpilled() != 998) {
+        cout << "spilled " << chan.getSpilled() << " of 998" << endl;
+        return false;
+    }
+    for (int i = 0; i < 500; i++) got.push_back(readInt(chan));
+    for (int i = 1000; i < 1500; i++) chan.write(i, nullptr);
+    for (int i = 500; i < 1500; i++) got.push_back(readInt(chan));
+    for (int i = 0; i < 1500; i++) expected.push_back(i);
+    if (!expectOrder("spill", got, expected)) return false;
+
+    //a concurrent reader sees the same order
+    got.clear();
+    thread reader([&]() {
+        for (int i = 0; i < 1500; i++) got.push_back(readInt(chan));
+    });
+    for (int i = 0; i < 1500; i++) chan.write(i, nullptr);
+    reader.join();
+    return expectOrder("concurrent spill", got, expected) && chan.getSpilled() == 0;
+}
+
+//a spill that drains and refills keeps reusing its tail segment instead of
+//opening a new file (under the coordinator lock) at every burst edge
+bool checkSpillChurn() {
+    string directory = std::filesystem::temp_directory_path();
+    Channel::SpillConfig config{directory, Channel::trivialSerializer<int>(), 1 << 20};
+    Channel::Chan chan{1, config, "spillChurn"};
+    vector<int> got, expected;
+    auto start = steady_clock::now();
+    for (int i = 0; i < 4000; i += 2) {
+        chan.write(i, nullptr);
+        chan.write(i + 1, nullptr);
+        got.push_back(readInt(chan));
+        got.push_back(readInt(chan));
+        expected.push_back(i);
+        expected.push_back(i + 1);
+    }
+    cout << "spill churn: 8000 ops in " << duration_cast<milliseconds>(steady_clock::now() - start).count() << "ms" << endl;
+    if (!expectOrder("spill churn", got, expected)) return false;
+    //segment files are named <chan>.<pid>.<queue>.<segment>.seg
+    string prefix = "spillChurn." + to_string(getpid()) + ".";
+    for (auto &entry : std::filesystem::directory_iterator(directory)) {
+        string name = entry.path().filename();
+        if (name.rfind(prefix, 0) != 0) continue;
+        string stem = name.substr(0, name.size() - 4);
+        int segment = stoi(stem.substr(stem.rfind('.') + 1));
+        if (segment > 2) {
+            cout << "spill churn opened segment " << segment << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//capacity grows while writers block, stays in bounds, shrinks back when idle,
+//and a resize never lets a new writer overtake one already parked
+bool checkAdaptive() {
+    Channel::Chan chan{Channel::AdaptiveConfig{1, 64, 20ms}, "adaptiveFifo"};
+    vector<int> got;
+    chan.write(0, nullptr);
+    uint64_t entered = Channel::enteredSelects();
+    thread parked([&]() {
+        chan.write(1, nullptr);
+    });
+    if (!Channel::waitQuiescent(entered + 1, 10s)) {
+        cout << "adaptive writer never parked" << endl;
+        parked.detach();
+        return false;
+    }
+    this_thread::sleep_for(50ms);
+    thread late([&]() {
+        chan.write(2, nullptr);
+    });
+    if (!Channel::waitQuiescent(entered + 2, 10s)) {
+        cout << "adaptive late writer never settled" << endl;
+        parked.detach();
+        late.detach();
+        return false;
+    }
+    for (int i = 0; i < 3; i++) got.push_back(readInt(chan));
+    parked.join();
+    late.join();
+    if (!expectOrder("adaptive fifo", got, {0, 1, 2})) return false;
+
+    Channel::AdaptiveConfig config{2, 8, 10ms};
+    Channel::Chan burst{config, "adaptiveBurst"};
+    thread writer([&]() {
+        for (int i = 0; i < 100; i++) burst.write(i, nullptr);
+    });
+    got.clear();
+    vector<int> expected;
+    for (int i = 0; i < 100; i++) {
+        this_thread::sleep_for(1ms);
+        got.push_back(readInt(burst));
+        expected.push_back(i);
+    }
+    writer.join();
+    if (!expectOrder("adaptive burst", got, expected)) return false;
+    int peak = 0;
+    for (auto &event : burst.getResizeHistory()) {
+        if (event.to < config.minCapacity || event.to > config.maxCapacity) {
+            cout << "adaptive resized out of bounds to " << event.to << endl;
+            return false;
+        }
+        peak = max(peak, event.to);
+    }
+    if (peak != config.maxCapacity) {
+        cout << "adaptive peaked at " << peak << " under blocked writers" << endl;
+        return false;
+    }
+    this_thread::sleep_for(10 * config.window);
+    if (burst.getCapacity() != config.minCapacity) {
+        cout << "adaptive capacity " << burst.getCapacity() << " after idle windows" << endl;
+        return false;
+    }
+    return true;
+}
+
+//copies of a payload, moving it is free
+struct CopyCounted {
+    static inline std::atomic<int> copies{0};
+    int val = 0;
+    CopyCounted(int val) : val(val) {}
+    CopyCounted(const CopyCounted &other) : val(other.val) {
+        copies++;
+    }
+    CopyCounted(CopyCounted &&other) = default;
+    CopyCounted &operator=(const CopyCounted &other) {
+        val = other.val;
+        copies++;
+        return *this;
+    }
+    CopyCounted &operator=(CopyCounted &&other) = default;
+};
+
+//values travel through buffered and unbuffered chans and pipeline stages by move
+bool checkMoves() {
+    namespace Pipeline = Channel::Pipeline;
+    CopyCounted::copies = 0;
+    Channel::Chan buffered{4, "moveBuffered"}, unbuffered{"moveUnbuffered"};
+    Pipeline::send(&buffered, CopyCounted{1});
+    any val = Pipeline::recv(&buffered);
+    thread writer([&]() {
+        Pipeline::send(&unbuffered, std::move(val));
+    });
+    val = Pipeline::recv(&unbuffered);
+    writer.join();
+
+    Channel::Chan in{4, "moveIn"}, mapped{4, "moveMapped"}, out{4, "moveOut"};
+    Pipeline::Stage identity = Pipeline::map(&in, &mapped, [](any a) {
+        return a;
+    });
+    Pipeline::Stage parallel = Pipeline::parallelMap(&mapped, &out, 2, [](any a) {
+        return a;
+    }, true);
+    thread source([&]() {
+        for (int i = 0; i < 100; i++) Pipeline::send(&in, CopyCounted{i});
+        Pipeline::close(&in);
+    });
+    int n = 0;
+    for (any a = Pipeline::recv(&out); !Pipeline::isEnd(a); a = Pipeline::recv(&out)) n++;
+    source.join();
+    if (any_cast<CopyCounted &>(val).val != 1 || n != 100 || CopyCounted::copies != 0) {
+        cout << "payloads copied " << CopyCounted::copies << " times" << endl;
+        return false;
+    }
+    return true;
+}
+
+//parks a named Select on one case of pChan
+thread parkSelect(const string &name, Channel::Chan *pChan, Channel::METHOD method) {
+    return thread([ = ]() {
+        auto task = [](const std::string &, const std::string &, const any &) {
+            return true;
+        };
+        if (method == Channel::READ) {
+            Channel::Select{name, Channel::Case{pChan >> any{}, task}};
+        } else {
+            Channel::Select{name, Channel::Case{pChan << any{0}, task}};
+        }
+    });
+}
 
-    assert(emulateResult.find(runResult) != emulateResult.end());
-    return;
+//true once num more Selects are parked and blocked past threshold
+bool parkedPast(uint64_t &entered, int num, chrono::nanoseconds threshold) {
+    entered += num;
+    if (!Channel::waitQuiescent(entered, 10s)) {
+        cout << "detector selects never parked" << endl;
+        return false;
+    }
+    this_thread::sleep_for(threshold * 2);
+    return true;
 }
+
+bool checkDetector() {
+    //declared endpoints: A writes chan2 after reading chan1, B the other way round
+    {
+        Channel::Chan chan1{"detChan1"}, chan2{"detChan2"};
+        Channel::Detector detector({&chan1, &chan2}, 10ms);
+        detector.addEndpoint(&chan2, Channel::WRITE, "A");
+        detector.addEndpoint(&chan1, Channel::WRITE, "B");
+        uint64_t entered = Channel::enteredSelects();
+        thread a = parkSelect("A", &chan1, Channel::READ);
+        thread b = parkSelect("B", &chan2, Channel::READ);
+        bool parked = parkedPast(entered, 2, 10ms);
+        Channel::DetectorReport report = detector.check();
+        chan1.write(0, nullptr);
+        chan2.write(0, nullptr);
+        a.join();
+        b.join();
+        if (!parked) return false;
+        if (report.cycles.size() != 1 || report.cycles[0].size() != 2) {
+            cout << "declared A/B cycle not reported" << endl;
+            return false;
+        }
+    }
+    //Chan::read and Chan::write share the chan name, an idle reader must not
+    //wait on the writer seen earlier under that name
+    {
+        Channel::Chan chan{"detIdle"};
+        Channel::Detector detector({&chan}, 10ms);
+        uint64_t entered = Channel::enteredSelects();
+        thread writer([&]() {
+            chan.write(0, nullptr);
+        });
+        bool parked = parkedPast(entered, 1, 10ms);
+        bool writerSeen = parked && !detector.check().stalls.empty();
+        readInt(chan);
+        writer.join();
+        if (!writerSeen) {
+            cout << "blocked chan.write not reported as a stall" << endl;
+            return false;
+        }
+        entered++;
+        thread reader([&]() {
+            readInt(chan);
+        });
+        parked = parkedPast(entered, 1, 10ms);
+        Channel::DetectorReport report = detector.check();
+        chan.write(0, nullptr);
+        reader.join();
+        if (!parked) return false;
+        if (report.stalls.empty() || !report.cycles.empty()) {
+            cout << "idle chan.read reported as a cycle" << endl;
+            return false;
+        }
+    }
+    //X and Y were seen writing the chan the other one now reads, which makes
+    //a cycle until those learned endpoints go unseen for kEndpointTtl thresholds
+    {
+        const auto threshold = 1ms;
+        Channel::Chan chan1{"detLearn1"}, chan2{"detLearn2"};
+        Channel::Detector detector({&chan1, &chan2}, threshold);
+        uint64_t entered = Channel::enteredSelects();
+        thread x = parkSelect("X", &chan2, Channel::WRITE);
+        thread y = parkSelect("Y", &chan1, Channel::WRITE);
+        bool parked = parkedPast(entered, 2, threshold);
+        if (parked) detector.check();
+        readInt(chan1);
+        readInt(chan2);
+        x.join();
+        y.join();
+        if (!parked) return false;
+
+        entered += 2;
+        x = parkSelect("X", &chan1, Channel::READ);
+        y = parkSelect("Y", &chan2, Channel::READ);
+        parked = parkedPast(entered, 2, threshold);
+        Channel::DetectorReport fresh = detector.check();
+        this_thread::sleep_for(Channel::Detector::kEndpointTtl * threshold * 2);
+        Channel::DetectorReport expired = detector.check();
+        chan1.write(0, nullptr);
+        chan2.write(0, nullptr);
+        x.join();
+        y.join();
+        if (!parked) return false;
+        if (fresh.cycles.size() != 1) {
+            cout << "cycle over learned endpoints not reported" << endl;
+            return false;
+        }
+        if (expired.stalls.size() != 2 || !expired.cycles.empty()) {
+            cout << "learned endpoints did not expire" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//collects ints until EndOfStream, batches are flattened with a -1 after each
+vector<int> drain(Channel::Chan *pChan) {
+    namespace Pipeline = Channel::Pipeline;
+    vector<int> ret;
+    for (any a = Pipeline::recv(pChan); !Pipeline::isEnd(a); a = Pipeline::recv(pChan)) {
+        if (a.type() != typeid(Pipeline::Batch)) {
+            ret.push_back(any_cast<int>(a));
+            continue;
+        }
+        for (any &b : any_cast<Pipeline::Batch &>(a)) ret.push_back(any_cast<int>(b));
+        ret.push_back(-1);
+    }
+    return ret;
+}
+
+//every stage delivers all values in input order and forwards EndOfStream
+bool checkPipeline() {
+    namespace Pipeline = Channel::Pipeline;
+    auto feed = [](Channel::Chan *pChan, int num) {
+        return thread([ = ]() {
+            for (int i = 0; i < num; i++) Pipeline::send(pChan, i);
+            Pipeline::close(pChan);
+        });
+    };
+    vector<int> expected;
+    {
+        Channel::Chan in{4, "pipeIn"}, mapped{4, "pipeMapped"}, out{4, "pipeOut"};
+        Pipeline::Stage plusOne = Pipeline::map(&in, &mapped, [](any a) -> any {
+            return any_cast<int>(a) + 1;
+        });
+        Pipeline::Stage even = Pipeline::filter(&mapped, &out, [](const any & a) {
+            return any_cast<int>(a) % 2 == 0;
+        });
+        thread source = feed(&in, 1000);
+        vector<int> got = drain(&out);
+        source.join();
+        for (int i = 2; i <= 1000; i += 2) expected.push_back(i);
+        if (!expectOrder("map filter", got, expected)) return false;
+    }
+
+    //one slow value holds back the ordered output, and how far ahead the
+    //workers may run past the oldest value not yet emitted
+    const int num = 5000;
+    const size_t workerNum = 4;
+    std::atomic<int> emitted{0}, maxAhead{0};
+    for (bool ordered : {true, false}) {
+        Channel::Chan in{16, "parallelIn"}, out{16, "parallelOut"};
+        Pipeline::Stage stage = Pipeline::parallelMap(&in, &out, workerNum, [&](any a) -> any {
+            int val = any_cast<int>(a);
+            maxAhead = max(maxAhead.load(), val - emitted.load());
+            if (val == 10) this_thread::sleep_for(100ms);
+            return val;
+        }, ordered);
+        thread source = feed(&in, num);
+        vector<int> got;
+        emitted = 0;
+        for (any a = Pipeline::recv(&out); !Pipeline::isEnd(a); a = Pipeline::recv(&out)) {
+            got.push_back(any_cast<int>(a));
+            emitted = static_cast<int>(got.size());
+        }
+        source.join();
+        expected.clear();
+        for (int i = 0; i < num; i++) expected.push_back(i);
+        if (!ordered) sort(got.begin(), got.end());
+        if (!expectOrder(ordered ? "ordered parallelMap" : "parallelMap", got, expected)) return false;
+        //credits bound the chunks in flight, the chans around add a few values
+        int bound = static_cast<int>(4 * workerNum * Pipeline::kMaxChunk) + 64;
+        if (ordered && maxAhead > bound) {
+            cout << "ordered parallelMap ran " << maxAhead << " values ahead, bound " << bound << endl;
+            return false;
+        }
+    }
+
+    //flushes by count, then the remainder on EndOfStream
+    {
+        Channel::Chan in{16, "batchIn"}, out{4, "batchOut"};
+        Pipeline::Stage stage = Pipeline::batch(&in, &out, 3, 200ms);
+        thread source = feed(&in, 7);
+        vector<int> got = drain(&out);
+        source.join();
+        if (!expectOrder("batch by count", got, {0, 1, 2, -1, 3, 4, 5, -1, 6, -1})) return false;
+    }
+    //flushes a partial batch on the next tick
+    {
+        Channel::Chan in{16, "batchTimeIn"}, out{4, "batchTimeOut"};
+        Pipeline::Stage stage = Pipeline::batch(&in, &out, 100, 20ms);
+        Pipeline::send(&in, 0);
+        Pipeline::send(&in, 1);
+        any a = Pipeline::recv(&out);
+        Pipeline::close(&in);
+        vector<int> got;
+        for (any &b : any_cast<Pipeline::Batch &>(a)) got.push_back(any_cast<int>(b));
+        if (!expectOrder("batch by time", got, {0, 1})) return false;
+        if (!Pipeline::isEnd(Pipeline::recv(&out))) {
+            cout << "batch did not forward EndOfStream" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//higher levels go first, each level in write order, and waiting values age upwards
+bool checkPriorityOrder() {
+    auto write = [](Channel::Chan &chan, int val, int priority) {
+        chan.write(val, nullptr, priority);
+    };
+    vector<int> got;
+    Channel::Chan chan{4, Channel::PriorityConfig{3, 1s}, "priorityOrder"};
+    for (int i = 0; i < 4; i++) {
+        write(chan, i, 0);
+        write(chan, 100 + i, 2);
+        write(chan, 50 + i, 1);
+    }
+    for (int i = 0; i < 12; i++) got.push_back(readInt(chan));
+    if (!expectOrder("priority", got, {100, 101, 102, 103, 50, 51, 52, 53, 0, 1, 2, 3})) return false;
+
+    //a writer parked on a full level is admitted behind that level, not ahead of a higher one
+    got.clear();
+    Channel::Chan blocking{2, Channel::PriorityConfig{2, 1s}, "priorityBlocking"};
+    write(blocking, 1, 0);
+    write(blocking, 2, 0);
+    uint64_t entered = Channel::enteredSelects();
+    thread writer([&]() {
+        write(blocking, 3, 0);
+    });
+    if (!Channel::waitQuiescent(entered + 1, 10s)) {
+        cout << "priority writer never parked" << endl;
+        writer.detach();
+        return false;
+    }
+    write(blocking, 100, 1);
+    for (int i = 0; i < 4; i++) got.push_back(readInt(blocking));
+    writer.join();
+    if (!expectOrder("priority admission", got, {100, 1, 2, 3})) return false;
+
+    //waiting three agings lifts a bulk value above a fresh top level one
+    got.clear();
+    Channel::Chan aging{4, Channel::PriorityConfig{3, 20ms}, "priorityAging"};
+    write(aging, 1, 0);
+    this_thread::sleep_for(70ms);
+    write(aging, 100, 2);
+    for (int i = 0; i < 2; i++) got.push_back(readInt(aging));
+    return expectOrder("priority aging", got, {1, 100});
+}
+
+// usage: test_bin firstSeed [maxSelect] [seedNum]
+//        test_bin order
 int main(int argc, char** args) {
-    int seed = stoi(args[1]);
-    std::cout << "seed:" << seed << std::endl;
-    std::mt19937 engine(seed);
-    testcase(engine);
+    if (string(args[1]) == "order") {
+        bool ok = checkSpillOrder() && checkSpillChurn() && checkAdaptive() && checkPriorityOrder() && checkMoves() && checkPipeline() && checkDetector();
+        cout << (ok ? "order checks passed" : "order checks failed") << endl;
+        return ok ? 0 : 1;
+    }
+    int firstSeed = stoi(args[1]);
+    int maxSelect = argc > 2 ? stoi(args[2]) : 6;
+    int seedNum = argc > 3 ? stoi(args[3]) : 1;
+    for (int seed = firstSeed; seed < firstSeed + seedNum; seed++) {
+        std::cout << "seed:" << seed << std::endl;
+        std::mt19937 engine(seed);
+        if (!testcase(engine, maxSelect)) {
+            std::cout << "failed at seed:" << seed << std::endl;
+            return 1;
+        }
+    }
     return 0;
 }
\ No newline at end of file
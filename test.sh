@@ -1,4 +1 @@
-for i in {0..99}
-do
-    ./test_bin $i
-done
\ No newline at end of file
+./test_bin order && ./test_bin 0 6 1000 && ./test_bin 1000 20 500